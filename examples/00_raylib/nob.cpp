@@ -1,3 +1,4 @@
+#define NOB_IMPLEMENTATION
 #include "nob.hpp"
 
 using namespace nob;
@@ -7,36 +8,37 @@ fs::path app_name = "00_raylib";
 int build_app()
 {
     fs::path raylib = "raylib-5.0";
-    std::vector<fs::path> sources = { "src/main.cpp" };
+    std::vector<fs::path> sources = glob("src/**/*.cpp");
     mkdir(build_dir);
+    BuildOutputs outputs(build_dir);
 
     // Compile raylib static library
     info("Building raylib static library...");
-    cd(build_dir);
     {
         std::string raylib_url = "https://github.com/raysan5/raylib/archive/refs/tags/5.0.tar.gz";
 
         info("Downloading and extracting raylib...");
-        if (!download_and_extract(raylib_url, ".", Verbosity::Verbose)) {
+        if (!download_and_extract(raylib_url, build_dir, Verbosity::Verbose)) {
             error("Could not download or extract raylib");
             return 1;
         }
-        mkdir(raylib / "build");
+        fs::path raylib_build = build_dir / raylib / "build";
+        mkdir(raylib_build);
         Cmd cmd("cmake", "..", "-DCMAKE_POLICY_VERSION_MINIMUM=3.5");
-        cmd.set_wd(raylib / "build");
+        cmd.set_wd(raylib_build);
         if (cmd.run_sync() != 0) {
             error("Failed to run cmake for raylib");
             return 1;
         }
         cmd.reset();
         cmd.add("make");
-        cmd.set_wd(raylib / "build");
+        cmd.set_wd(raylib_build);
         if (cmd.run_sync() != 0) {
             error("Failed to run make for raylib");
             return 1;
         }
     }
-    cd(get_project_root());
+    outputs.claim("raylib", { build_dir / "5.0.tar.gz", build_dir / raylib });
 
     // Build main app
     info("Building app...");
@@ -60,12 +62,22 @@ int build_app()
         }
         info("App build completed!");
         info("Executable: ", app_executable);
+        outputs.claim("app", { app_executable });
     }
 
+    // Drop outputs of targets this script no longer builds
+    outputs.gc();
+
     return 0;
 }
 
+// Keeps the raylib download and build, they rarely change and take long
 int clean() {
+    BuildOutputs(build_dir).clean({ "app" });
+    return 0;
+}
+
+int distclean() {
     remove_recursive(build_dir);
     return 0;
 }
@@ -73,9 +85,11 @@ int clean() {
 int main(int argc, char** argv) {
 
     go_rebuild_urself(argc, argv, __FILE__);
+    parse_log_flags(argc, argv);
 
     if (argc < 2) {
         error("Need subcommand");
+        return 1;
     }
 
     std::vector<std::string> args(argc);
@@ -84,10 +98,31 @@ int main(int argc, char** argv) {
         args[i] = std::string(argv[i]);
     }
 
+    // Overlapping runs take turns on build/, pass --no-wait to fail instead
+    BuildLockOptions lock_options;
+    for (std::size_t i = 2; i < args.size(); i++) {
+        if (args[i] == "--no-wait") {
+            lock_options.wait = false;
+        }
+    }
+    if (args[1] == "outputs") {
+        lock_options.mode = LockMode::Shared;
+    }
+    auto lock = BuildLock::acquire(build_dir, lock_options);
+    if (!lock) {
+        return 1;
+    }
+
     if (args[1] == "build") {
         return build_app();
     } else if (args[1] == "clean") {
         return clean();
+    } else if (args[1] == "distclean") {
+        return distclean();
+    } else if (args[1] == "outputs") {
+        for (const auto& target : BuildOutputs(build_dir).targets()) {
+            std::cout << target << '\n';
+        }
     }
 
 
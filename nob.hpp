@@ -1,285 +1,5436 @@
-#pragma once
+#ifndef NOB_HPP_
+#define NOB_HPP_
+
+/*
+ * Declarations only, unless NOB_IMPLEMENTATION is defined before including
+ * this file, in exactly one translation unit:
+ *
+ *     #define NOB_IMPLEMENTATION
+ *     #include "nob.hpp"
+ *
+ * Build scripts linked against a prebuilt libnob.a (see build_libnob()) also
+ * define NOB_IMPLEMENTATION_PREBUILT to skip the implementation.
+ */
 
 #include <mutex>
 #include <vector>
 #include <string>
 #include <stdexcept>
 #include <filesystem>
-#include <fstream>
-#include <cstdio>
-#include <cstring>
-#include <iostream>
-#include <unistd.h>
-#include <sys/wait.h>
+#include <ostream>
+#include <sstream>
+#include <string_view>
+#include <charconv>
+#include <type_traits>
 #include <sys/types.h>
-#include <limits.h>
 #include <optional>
+#include <map>
+#include <set>
+#include <utility>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+
+namespace nob {
+
+namespace fs = std::filesystem;
+
+enum class Verbosity {
+    Quiet,
+    Quieter,
+    Verbose,
+};
+
+enum class LogLevel {
+    Info,
+    Warning,
+    Error,
+};
+
+/*
+ * Log calls below NOB_LOG_LEVEL (0 = Info, 1 = Warning, 2 = Error) compile
+ * to nothing. Above it, set_log_level() filters at runtime, before anything
+ * is formatted. go_rebuild_urself() picks up a `#define NOB_LOG_LEVEL <n>`
+ * in the script and builds its PCH and libnob.a with the same level.
+ */
+#ifndef NOB_LOG_LEVEL
+#define NOB_LOG_LEVEL 0
+#endif
+
+/* Like info()/warning()/error(), but the arguments aren't even evaluated when filtered out */
+#define NOB_INFO(...) NOB_LOG_IF_(Info, info, __VA_ARGS__)
+#define NOB_WARNING(...) NOB_LOG_IF_(Warning, warning, __VA_ARGS__)
+#define NOB_ERROR(...) NOB_LOG_IF_(Error, error, __VA_ARGS__)
+#define NOB_LOG_IF_(lvl, fn, ...) \
+    do { \
+        if constexpr (static_cast<int>(nob::LogLevel::lvl) >= NOB_LOG_LEVEL) { \
+            if (nob::log_enabled(nob::LogLevel::lvl)) { \
+                nob::fn(__VA_ARGS__); \
+            } \
+        } \
+    } while (0)
+
+namespace detail {
+
+inline std::atomic<int> runtime_log_level { NOB_LOG_LEVEL };
+
+}
+
+inline bool log_enabled(LogLevel lvl)
+{
+    return static_cast<int>(lvl) >= NOB_LOG_LEVEL
+        && static_cast<int>(lvl) >= detail::runtime_log_level.load(std::memory_order_relaxed);
+}
+
+void set_log_level(LogLevel lvl);
+
+/* Handles and removes --quiet (warnings and errors only) and --silent (errors only) from argv */
+void parse_log_flags(int& argc, char** argv);
+
+/* What an asynchronous log does with a record when its ring buffer is full */
+enum class LogOverflow {
+    Block,
+    Drop,
+};
+
+struct AsyncLogOptions {
+    std::size_t capacity = 4096;             /* records, rounded up to a power of two */
+    LogOverflow overflow = LogOverflow::Block;
+    std::optional<fs::path> file;            /* also appended here, without colors */
+};
+
+/*
+ * Hands std::cout/std::cerr log lines to a lock-free ring buffer drained by a
+ * background thread, so a slow terminal or log file never stalls the caller.
+ * Call from one thread, it's undone by disable_async_log() or at exit.
+ */
+void enable_async_log(AsyncLogOptions options = {});
+
+/* Writes out every pending record and stops the background thread */
+void disable_async_log();
+
+/* Records thrown away because the ring was full, with LogOverflow::Drop */
+std::size_t dropped_log_records();
+
+namespace detail {
+
+void format_quoted(std::string& out, std::string_view s);
+
+template<typename T>
+void format_number(std::string& out, T value)
+{
+    char buf[64];
+    auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), value);
+    if (ec == std::errc()) {
+        out.append(buf, end);
+    }
+}
+
+}
+
+/*
+ * Appends the text form of `value` to `out`: strings as they are, numbers
+ * and bools through std::to_chars but spelled as a default std::ostream
+ * would, paths in double quotes and Cmds as a shell command line. Other
+ * types with an operator<< go through a std::ostringstream.
+ */
+template<typename T>
+void format_to(std::string& out, const T& value)
+{
+    if constexpr (std::is_same_v<T, char> || std::is_same_v<T, signed char> || std::is_same_v<T, unsigned char>) {
+        out.push_back(static_cast<char>(value));
+    } else if constexpr (std::is_same_v<T, bool>) {
+        out.push_back(value ? '1' : '0');
+    } else if constexpr (std::is_convertible_v<const T&, std::string_view>) {
+        out.append(std::string_view(value));
+    } else if constexpr (std::is_same_v<T, fs::path>) {
+        detail::format_quoted(out, value.native());
+    } else if constexpr (std::is_floating_point_v<T>) {
+        /* %g with 6 significant digits, the std::ostream default */
+        char buf[64];
+        auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), value, std::chars_format::general, 6);
+        if (ec == std::errc()) {
+            out.append(buf, end);
+        }
+    } else if constexpr (std::is_arithmetic_v<T>) {
+        detail::format_number(out, value);
+    } else {
+        std::ostringstream ss;
+        ss << value;
+        out.append(ss.str());
+    }
+}
+
+/* Concatenates the text form of every argument, see format_to() */
+template<typename... Args>
+std::string format(const Args&... args)
+{
+    std::string out;
+    (format_to(out, args), ...);
+    return out;
+}
+
+namespace detail {
+
+const char* log_prefix(LogLevel lvl);
+
+/* This thread's line buffer, reused so logging doesn't allocate once warmed up */
+std::string& log_buffer();
+
+/* Emits one complete log line to fd 1 or 2 with a single write(), or as an event */
+void log_write(int fd, LogLevel lvl, const std::string& line);
+
+/* Same, for any stream: std::cout/std::cerr map to their fds, others lock only `out` */
+void log_write(std::ostream& out, LogLevel lvl, const std::string& line);
+
+template<typename Sink, typename... Args>
+void log_to(Sink&& sink, LogLevel lvl, const Args&... args)
+{
+    if (!log_enabled(lvl)) {
+        return;
+    }
+
+    /* Formatted without holding any lock */
+    std::string& line = log_buffer();
+    line.clear();
+    line.append(log_prefix(lvl));
+    (format_to(line, args), ...);
+    line.push_back('\n');
+
+    log_write(sink, lvl, line);
+}
+
+}
+
+template<typename... Args>
+void log(std::ostream& out, LogLevel lvl, const Args&... args)
+{
+    detail::log_to(out, lvl, args...);
+}
+
+template<typename... Args>
+void error(const Args&... args)
+{
+    if constexpr (static_cast<int>(LogLevel::Error) >= NOB_LOG_LEVEL) {
+        detail::log_to(2, LogLevel::Error, args...);
+    }
+}
+
+template<typename... Args>
+void info(const Args&... args)
+{
+    if constexpr (static_cast<int>(LogLevel::Info) >= NOB_LOG_LEVEL) {
+        detail::log_to(1, LogLevel::Info, args...);
+    }
+}
+
+template<typename... Args>
+void warning(const Args&... args)
+{
+    if constexpr (static_cast<int>(LogLevel::Warning) >= NOB_LOG_LEVEL) {
+        detail::log_to(1, LogLevel::Warning, args...);
+    }
+}
+
+struct EventLogOptions {
+    std::optional<fs::path> file; /* appended to, created if missing */
+    int fd = -1;                  /* written to when there's no file, e.g. a pipe from CI */
+    bool replace_log = false;     /* send log lines only as "log" events, not to the terminal */
+};
+
+/*
+ * Machine-readable output: one JSON object per line for every command start
+ * and finish (exit code, duration, rusage), cache hit or miss, download and
+ * log line. Each object has "ts" (unix time in ms) and "event" first.
+ * Call from one thread, like enable_async_log().
+ */
+bool enable_event_log(EventLogOptions options);
+
+void disable_event_log();
+
+namespace detail {
+
+inline std::atomic<bool> event_log_on { false };
+
+void json_string(std::string& out, std::string_view s);
+
+void event_write(const std::string& line);
+
+}
+
+inline bool event_log_enabled()
+{
+    return detail::event_log_on.load(std::memory_order_relaxed);
+}
+
+/*
+ * One event, built field by field and written as a single line by emit().
+ * Check event_log_enabled() first where gathering the fields costs anything.
+ */
+class Event {
+public:
+    explicit Event(std::string_view name);
+
+    template<typename T>
+    Event& field(std::string_view key, const T& value);
+
+    void emit();
+
+private:
+    std::string m_line;
+};
+
+template<typename T>
+Event& Event::field(std::string_view key, const T& value)
+{
+    m_line.push_back(',');
+    detail::json_string(m_line, key);
+    m_line.push_back(':');
+    if constexpr (std::is_same_v<T, bool>) {
+        m_line.append(value ? "true" : "false");
+    } else if constexpr (std::is_floating_point_v<T>) {
+        if (std::isfinite(value)) {
+            detail::format_number(m_line, value);
+        } else {
+            m_line.append("null");
+        }
+    } else if constexpr (std::is_integral_v<T> && !std::is_same_v<T, char>) {
+        detail::format_number(m_line, value);
+    } else if constexpr (std::is_same_v<T, fs::path>) {
+        detail::json_string(m_line, value.native());
+    } else if constexpr (std::is_same_v<T, std::vector<std::string>>) {
+        m_line.push_back('[');
+        for (std::size_t i = 0; i < value.size(); i++) {
+            if (i > 0) {
+                m_line.push_back(',');
+            }
+            detail::json_string(m_line, value[i]);
+        }
+        m_line.push_back(']');
+    } else {
+        std::string text;
+        format_to(text, value);
+        detail::json_string(m_line, text);
+    }
+    return *this;
+}
+
+struct FileStat {
+    bool exists = false;
+    bool is_dir = false;
+    std::uintmax_t size = 0;
+    std::int64_t mtime = 0; /* ns since the epoch */
+};
+
+/*
+ * stat() through a process-wide cache, so checking the same inputs again
+ * costs no syscall. Whatever nob writes itself (mkdir(), remove(),
+ * materialize(), ...) is invalidated as it's written. Commands may write
+ * anywhere, so running one drops the whole cache: do dirtiness checks in
+ * one pass before running anything.
+ */
+FileStat stat_cached(const fs::path& path);
+
+/* Fills the cache for all of `paths` at once, with statx() on up to `jobs` threads */
+void prefetch_stats(const std::vector<fs::path>& paths,
+                    std::size_t jobs = std::thread::hardware_concurrency());
+
+/* Forgets `path`, everything below it and its parent, or everything when empty */
+void invalidate_stats(const fs::path& path = {});
+
+bool mkdir(const fs::path& path);
+
+void remove(const fs::path& path);
+
+enum class RemoveMode {
+    Wait,       /* deleted in this process before remove_recursive() returns */
+    Background, /* directories are renamed aside and deleted by a detached `rm -rf` */
+};
+
+/*
+ * Deletes `path` and everything below it, removing subtrees on up to `jobs`
+ * threads with openat()/getdents64()/unlinkat(). Symlinks are removed, not
+ * followed. A missing `path` is nothing to do; entries that can't be removed
+ * are logged as errors and left in place, nothing throws.
+ *
+ * In the Background mode a directory is renamed to the sibling
+ * `<path>.nob_trash.<pid>.<n>` and handed to a detached `rm -rf`, which
+ * outlives nob, so the caller continues right away, e.g. with the next
+ * build. Anything that isn't a directory, or a tree that can't be renamed
+ * or handed off, is removed as in the Wait mode.
+ */
+void remove_recursive(const fs::path& path,
+                      RemoveMode mode = RemoveMode::Wait,
+                      std::size_t jobs = std::thread::hardware_concurrency());
+
+/*
+ * Called for every entry below the walked root with its path (the root
+ * joined with the relative path) and whether it's a directory. For
+ * directories false means don't descend, for files leave it out.
+ */
+using WalkFilter = std::function<bool(const fs::path& path, bool is_dir)>;
+
+/*
+ * Lists the files below `root` on up to `jobs` threads with getdents64(),
+ * sorted. Symlinks to directories aren't followed. Listings are cached in
+ * .nob/dircache keyed by the directory's mtime, so unchanged directories
+ * aren't read again on the next run.
+ */
+std::vector<fs::path> walk(const fs::path& root,
+                           const WalkFilter& filter = {},
+                           std::size_t jobs = std::thread::hardware_concurrency());
+
+/*
+ * Files matching `pattern`, sorted: "*", "?" and "[...]" match within one
+ * path component and a "**" component matches any number of directories,
+ * so src, ** and *.cpp joined by slashes finds every .cpp file below src.
+ * Like the shell, wildcards don't match a leading '.'.
+ */
+std::vector<fs::path> glob(const std::string& pattern);
+
+enum class CopyMethod {
+    Reflink,       /* ioctl(FICLONE): shares extents copy-on-write (btrfs, xfs) */
+    Hardlink,      /* link(): shares the inode, treat the output as read-only */
+    CopyFileRange, /* copy_file_range(): in-kernel copy, no userspace buffers */
+    Copy,          /* read()/write() loop, last resort */
+};
+
+const char* to_string(CopyMethod m);
+
+std::ostream& operator<<(std::ostream& os, CopyMethod m);
+
+void format_to(std::string& out, CopyMethod m);
+
+/*
+ * Makes `to` have the contents of `from` as cheaply as the filesystem allows:
+ * reflink, then hardlink, then copy_file_range, then a plain copy. Meant for
+ * materializing artifacts out of caches and dependency stores, so a hardlinked
+ * output must not be modified in place. Returns the method that was used.
+ */
+std::optional<CopyMethod> materialize(const fs::path& from,
+                                      const fs::path& to,
+                                      bool allow_hardlink = true);
+
+/* When copy() and copy_tree() may leave a destination file alone */
+enum class CopyCheck {
+    SizeAndMtime, /* same size and mtime, copies get the source's mtime */
+    Hash,         /* same size and sha256, for trees whose mtimes aren't kept */
+    None,         /* always copy */
+};
+
+/*
+ * Copies `from` to `to` with reflinks or copy_file_range(), never through
+ * userspace buffers when the kernel can help, and never as a hardlink: the
+ * copy can be modified without touching the original. Returns false on failure.
+ */
+bool copy(const fs::path& from, const fs::path& to, CopyCheck check = CopyCheck::SizeAndMtime);
+
+/* Copies every file below `from` to the same place below `to`, on up to `jobs` threads */
+bool copy_tree(const fs::path& from,
+               const fs::path& to,
+               CopyCheck check = CopyCheck::SizeAndMtime,
+               std::size_t jobs = std::thread::hardware_concurrency());
+
+/*
+ * Content-addressed on-disk cache with a size cap and LRU eviction.
+ *
+ * Layout:
+ *   <dir>/lock            flock()ed by every operation, so several nob processes can share the cache
+ *   <dir>/index           "<key> <size> <last used ns>" per line, replaced atomically with rename()
+ *   <dir>/objects/<key>   the cached files
+ */
+class Cache {
+public:
+    Cache(fs::path dir, std::uintmax_t max_size);
+
+    /* Materializes the entry for `key` at `out`, returns std::nullopt on a miss */
+    std::optional<CopyMethod> get(const std::string& key, const fs::path& out, bool allow_hardlink = true);
+
+    bool contains(const std::string& key);
+
+    /* Stores a copy of `file` under `key` and evicts down to the size cap */
+    bool put(const std::string& key, const fs::path& file);
+
+    /* Evicts least recently used entries until the cache fits in its size cap */
+    void evict();
+
+    std::uintmax_t size();
+
+private:
+    struct Entry {
+        std::uintmax_t size;
+        std::int64_t last_used;
+    };
+
+    static void check_key(const std::string& key);
+
+    fs::path object_path(const std::string& key) const;
+
+    std::map<std::string, Entry> read_index() const;
+
+    void write_index(const std::map<std::string, Entry>& index) const;
+
+    void evict_locked(std::map<std::string, Entry>& index);
+
+    fs::path m_dir;
+    std::uintmax_t m_max_size;
+};
+
+/*
+ * Records which files each target produced, so a clean can remove exactly
+ * those and leave downloads and dependency builds in the same directory
+ * alone. Kept in `<build_dir>/.nob_outputs` as "<target>\t<path>" lines,
+ * with absolute paths, flock()ed and rewritten atomically like Cache's index.
+ */
+class BuildOutputs {
+public:
+    explicit BuildOutputs(fs::path build_dir);
+
+    /*
+     * Records `outputs` as everything `target` produces. Files it claimed
+     * before but no longer does are stale and get removed right away.
+     */
+    void claim(const std::string& target, const std::vector<fs::path>& outputs);
+
+    /* Removes the outputs of `targets`, or of every target when empty */
+    void clean(const std::vector<std::string>& targets = {});
+
+    /* Removes the outputs of targets that weren't claimed through this object */
+    void gc();
+
+    std::vector<std::string> targets();
+
+private:
+    using Db = std::map<std::string, std::vector<fs::path>>;
+
+    Db read_db() const;
+
+    void write_db(const Db& db) const;
+
+    /* Removes what `target` owns in `db` unless another target claims it too */
+    void remove_outputs(Db& db, const std::string& target, const std::vector<fs::path>& keep = {});
+
+    fs::path m_dir;
+    std::vector<std::string> m_claimed;
+};
+
+enum class LockMode {
+    Shared,     /* read-only queries, any number at once */
+    Exclusive,  /* anything that writes to the build directory */
+};
+
+struct BuildLockOptions {
+    LockMode mode = LockMode::Exclusive;
+    bool wait = true;                                 /* false: fail right away if another process holds it */
+    std::optional<std::chrono::milliseconds> timeout; /* give up waiting after this, wait forever if unset */
+};
+
+/*
+ * Advisory flock() on `<build_dir>/.nob_lock`, held for the object's lifetime
+ * so overlapping nob runs on one build directory take turns instead of
+ * writing over each other's outputs and partial downloads. Returns
+ * std::nullopt if the lock couldn't be taken within `options`. The fd is
+ * close-on-exec, commands started while holding it don't keep it alive.
+ */
+class BuildLock {
+public:
+    static std::optional<BuildLock> acquire(const fs::path& build_dir, BuildLockOptions options = {});
+
+    ~BuildLock();
+
+    BuildLock(const BuildLock&) = delete;
+    BuildLock& operator=(const BuildLock&) = delete;
+    BuildLock(BuildLock&& other) noexcept;
+    BuildLock& operator=(BuildLock&& other) noexcept;
+
+    LockMode mode() const;
+
+private:
+    BuildLock(int fd, LockMode mode);
+
+    void release();
+
+    int m_fd = -1;
+    LockMode m_mode;
+};
+
+std::string sha256(const std::string& data);
+
+std::optional<std::string> sha256_file(const fs::path& path);
+
+std::optional<std::string> read_file(const fs::path& path);
+
+/*
+ * Writes `data` to `path` only if its contents differ, so generated files
+ * keep their mtime and nothing depending on them rebuilds needlessly. The
+ * new contents go to a temp file that's rename()d into place. Returns
+ * whether the file changed, std::nullopt if it couldn't be written.
+ */
+std::optional<bool> write_file_if_changed(const fs::path& path, std::string_view data);
+
+/*
+ * Minimal HTTP/1.1 client (plain http only) with a bounded pool of
+ * keep-alive connections, safe to share between threads.
+ */
+class HttpClient {
+public:
+    struct Response {
+        int status = 0;
+        std::string body;
+    };
+
+    HttpClient(std::string host, std::string port, std::size_t max_connections = 8);
+
+    ~HttpClient();
+
+    HttpClient(const HttpClient&) = delete;
+    HttpClient& operator=(const HttpClient&) = delete;
+
+    std::optional<Response> request(const std::string& method, const std::string& path, const std::string& body = "");
+
+private:
+    int acquire(bool& reused);
+
+    void release(int fd, bool reusable);
+
+    int connect_to();
+
+    static bool send_all(int fd, const std::string& data);
+
+    /* Reads more bytes into `buf`, returns false on EOF or error */
+    static bool fill(int fd, std::string& buf);
+
+    static bool read_line(int fd, std::string& buf, std::size_t& pos, std::string& line);
+
+    static bool read_exact(int fd, std::string& buf, std::size_t& pos, std::size_t size, std::string& out);
+
+    static bool read_response(int fd, bool head, Response& response, bool& keep_alive);
+
+    std::string m_host;
+    std::string m_port;
+    std::size_t m_max_connections;
+    std::size_t m_open = 0;
+    std::vector<int> m_idle;
+    std::mutex m_mtx;
+    std::condition_variable m_cv;
+};
+
+/*
+ * Remote cache backend speaking the bazel-remote HTTP protocol:
+ *   GET/PUT <url>/cas/<sha256>   content addressed blobs
+ *   GET/PUT <url>/ac/<key>       action results, keyed by a sha256 of the action
+ *
+ * nob stores its own action results ("<sha256> <size>" of the output blob), so
+ * bazel-remote has to run with --disable_http_ac_validation.
+ */
+class RemoteCache {
+public:
+    enum class Store {
+        ActionCache,
+        Cas,
+    };
+
+    RemoteCache(const std::string& url, std::size_t max_connections = 8);
+
+    std::optional<std::string> get(Store store, const std::string& hash);
+
+    bool put(Store store, const std::string& hash, const std::string& data);
+
+    /* Fetches the output recorded for `action_key` into `out` */
+    bool fetch_output(const std::string& action_key, const fs::path& out);
+
+    /* Uploads `file` to the CAS and records it as the output of `action_key` */
+    bool store_output(const std::string& action_key, const fs::path& file);
+
+    /* Fetches many (action key, output) pairs at once, at most one request per pooled connection */
+    std::vector<bool> fetch_outputs(const std::vector<std::pair<std::string, fs::path>>& outputs);
+
+private:
+    struct Url {
+        std::string host;
+        std::string port;
+        std::string prefix;
+    };
+
+    static Url parse_url(const std::string& url);
+
+    std::string path(Store store, const std::string& hash) const;
+
+    Url m_url;
+    std::size_t m_max_connections;
+    HttpClient m_http;
+};
+
+/*
+ * A directory opened once, in place of cd(): the cwd is shared by every
+ * thread of the process, a Dir isn't, so steps in different directories
+ * can run at the same time. Relative paths given to its members are
+ * relative to it; `dir / path` gives an absolute path for everything else
+ * that takes one. Reads and writes go through the fd with the *at() calls,
+ * exists() looks up `dir / path` in the stat cache like the rest of nob.
+ */
+class Dir {
+public:
+    explicit Dir(const fs::path& path);
+
+    ~Dir();
+
+    Dir(const Dir&) = delete;
+    Dir& operator=(const Dir&) = delete;
+    Dir(Dir&& other) noexcept;
+    Dir& operator=(Dir&& other) noexcept;
+
+    int fd() const;
+
+    /* Absolute */
+    const fs::path& path() const;
+
+    fs::path operator/(const fs::path& relative) const;
+
+    /* Opens a subdirectory, creating it if needed */
+    Dir open(const fs::path& relative) const;
+
+    bool exists(const fs::path& relative) const;
+
+    bool mkdir(const fs::path& relative) const;
+
+    void remove(const fs::path& relative) const;
+
+    std::optional<std::string> read_file(const fs::path& relative) const;
+
+    std::optional<bool> write_file_if_changed(const fs::path& relative, std::string_view data) const;
+
+private:
+    int m_fd = -1;
+    fs::path m_path;
+};
+
+fs::path get_project_root();
+
+/* Changes the cwd of the whole process, prefer a Dir or Cmd::set_wd() where threads are involved */
+bool cd(const fs::path& path);
+
+class Cmd;
+
+/* The working dir and a command line that can be pasted into a shell */
+void format_to(std::string& out, const Cmd& cmd);
+
+namespace detail {
+
+/* Whether `Args` is a single Cmd, which the copy/move constructors take rather than the variadic one */
+template<typename... Args>
+struct is_single_cmd : std::false_type {};
+
+template<typename Arg>
+struct is_single_cmd<Arg> : std::is_same<std::decay_t<Arg>, Cmd> {};
+
+}
+
+class Cmd {
+public:
+    template<typename... Args, typename = std::enable_if_t<!detail::is_single_cmd<Args...>::value>>
+    Cmd(Args&&... args)
+    {
+        add(std::forward<Args>(args)...);
+    }
+
+    Cmd(const Cmd&) = default;
+    Cmd(Cmd&&) = default;
+    Cmd& operator=(const Cmd&) = default;
+    Cmd& operator=(Cmd&&) = default;
+    ~Cmd() = default;
+
+    template<typename... Args>
+    void add(Args&&... args)
+    {
+        (m_command.emplace_back(std::forward<Args>(args)), ...);
+    }
+
+    /* The child chdir()s there before exec, the parent's cwd is never touched */
+    void set_wd(const fs::path& path);
+
+    void set_wd(const Dir& dir);
+
+    int run_sync();
+
+    int run_sync_capture(std::ostream& out, bool merge_stderr = false);
+
+    /* Collects stdout and stderr separately, without echoing the command */
+    int run_sync_capture(std::string& out, std::string& err);
+
+    void reset();
+
+    const std::vector<std::string>& args() const;
+
+    const fs::path& wd() const;
+
+    /* Defined here so only ADL finds it, Cmd's variadic constructor would make it a candidate for anything */
+    friend std::ostream& operator<<(std::ostream& os, const Cmd& cmd)
+    {
+        std::string line;
+        format_to(line, cmd);
+        return os << line;
+    }
+
+private:
+    std::vector<std::string> m_command;
+    fs::path m_working_dir { "." };
+};
+
+/* Appends `arg` single-quoted if the shell would otherwise split or expand it */
+void format_shell_arg(std::string& out, std::string_view arg);
+
+enum class OutputPolicy {
+    Stream,       /* jobs write straight to the terminal, interleaved */
+    Buffered,     /* each job's output is printed as one block when it finishes */
+    QuietSuccess, /* like Buffered, but only for jobs that failed or wrote to stderr */
+};
+
+/*
+ * Runs `cmds` with up to `jobs` at a time, under a Progress status line.
+ * After the first failure no new commands are started. Returns whether all
+ * of them exited with 0.
+ */
+bool run_parallel(const std::vector<Cmd>& cmds,
+                  std::size_t jobs = std::thread::hardware_concurrency(),
+                  OutputPolicy policy = OutputPolicy::Buffered);
+
+/*
+ * Worker protocol: a WorkRequest is sent as one frame, answered by one
+ * WorkResponse frame. Paths in `inputs` and `outputs` are relative to `wd`.
+ */
+struct WorkRequest {
+    std::vector<std::string> argv;
+    std::string wd;
+    std::vector<std::pair<std::string, std::string>> inputs; /* path, sha256 */
+    std::vector<std::string> outputs;                        /* paths to send back */
+
+    std::string encode() const;
+
+    static WorkRequest decode(const std::string& data);
+};
+
+struct WorkResponse {
+    int exit_code = 1;
+    std::string output;                                      /* stdout and stderr, interleaved */
+    std::vector<std::pair<std::string, std::string>> files;  /* path, contents */
+
+    std::string encode() const;
+
+    static WorkResponse decode(const std::string& data);
+};
+
+/* Executes a WorkRequest on this machine */
+WorkResponse execute_work(const WorkRequest& request);
+
+/*
+ * Serves WorkRequests on a Unix domain socket, one thread per connection.
+ * serve() blocks until stop() is called from another thread, which also
+ * disconnects the clients.
+ */
+class WorkerServer {
+public:
+    WorkerServer(fs::path socket_path);
+
+    ~WorkerServer();
+
+    void serve();
+
+    void stop();
+
+private:
+    void connection(int fd);
+
+    fs::path m_socket_path;
+    int m_listen_fd;
+    std::atomic<bool> m_stopped { false };
+    std::map<int, std::thread> m_connections; /* by fd, so stop() can shut them down */
+    std::vector<std::thread> m_finished;      /* exited, joined by serve() or the destructor */
+    std::mutex m_mtx;
+    std::condition_variable m_cv;
+};
+
+/* Client side of the worker protocol, one request in flight per connection */
+class RemoteWorker {
+public:
+    RemoteWorker(const fs::path& socket_path);
+
+    ~RemoteWorker();
+
+    RemoteWorker(const RemoteWorker&) = delete;
+    RemoteWorker& operator=(const RemoteWorker&) = delete;
+
+    std::optional<WorkResponse> execute(const WorkRequest& request);
+
+    /*
+     * Runs `cmd` on the worker, prints its output and writes the requested
+     * `outputs` (relative to the command's working dir) locally.
+     */
+    int run(const Cmd& cmd,
+            const std::vector<fs::path>& inputs = {},
+            const std::vector<fs::path>& outputs = {});
+
+private:
+    int m_fd;
+};
+
+/*
+ * Pool of long-lived worker processes for tools with expensive startup.
+ *
+ * Each worker is started once as `tool... --persistent_worker` and then
+ * receives requests on stdin and answers on stdout, both as length-prefixed
+ * frames (see detail::write_frame):
+ *   request:  u32 argc, then argc times (u32 size, bytes)
+ *   response: u32 exit code, u32 size, output bytes
+ * Requests are handed to idle workers, so up to `count` of them run at once.
+ */
+class PersistentWorkerPool {
+public:
+    PersistentWorkerPool(Cmd tool, std::size_t count = std::thread::hardware_concurrency());
+
+    ~PersistentWorkerPool();
+
+    PersistentWorkerPool(const PersistentWorkerPool&) = delete;
+    PersistentWorkerPool& operator=(const PersistentWorkerPool&) = delete;
+
+    /* Sends one request, returns the worker's exit code and writes its output to `out` */
+    int request(const std::vector<std::string>& args, std::string* out = nullptr);
+
+private:
+    struct Worker {
+        pid_t pid;
+        int in;  /* worker's stdin */
+        int out; /* worker's stdout */
+    };
+
+    Worker& acquire();
+
+    void release(Worker& w, bool ok);
+
+    Worker spawn();
+
+    Cmd m_tool;
+    std::size_t m_count;
+    std::deque<Worker> m_workers; /* deque, so busy workers stay put while others are added */
+    std::vector<Worker*> m_idle;
+    std::mutex m_mtx;
+    std::condition_variable m_cv;
+};
+
+/*
+ * Ninja-style progress over a known set of targets. On a terminal a single
+ * status line
+ *
+ *     [123/4567] 38% ETA 1m12s CXX src/foo.cpp
+ *
+ * is redrawn in place at most ~30 times a second, log lines are printed
+ * above it and the "Running sync" echo of commands is left out. Otherwise
+ * every started target gets a plain line. The ETA comes from how long each
+ * target took in earlier runs, kept in `history`. One Progress at a time.
+ */
+class Progress {
+public:
+    Progress(std::vector<std::string> targets,
+             std::size_t jobs = 1,
+             fs::path history = fs::path(".nob") / "durations");
+
+    ~Progress();
+
+    Progress(const Progress&) = delete;
+    Progress& operator=(const Progress&) = delete;
+
+    /* Thread-safe, `description` is what's shown, e.g. "CXX src/foo.cpp" */
+    void start(const std::string& target, const std::string& description);
+
+    void finish(const std::string& target);
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    double expected_ms(const std::string& target) const;
+
+    std::string status_locked(Clock::time_point now) const;
+
+    void draw_locked(bool force);
+
+    void save_history();
+
+    std::vector<std::string> m_targets;
+    std::size_t m_jobs;
+    fs::path m_history_path;
+    std::map<std::string, double> m_history;            /* target -> ms, from earlier runs */
+    std::map<std::string, double> m_measured;           /* target -> ms, from this run */
+    std::map<std::string, Clock::time_point> m_running;
+    std::size_t m_started = 0;
+    std::size_t m_finished = 0;
+    double m_default_ms = 0;                            /* for targets never seen before */
+    std::string m_description;
+    Clock::time_point m_last_draw {};
+    bool m_tty = false;
+    std::mutex m_mtx;
+};
+
+/*
+ * Rebuilds and re-execs the running build script when it or anything it
+ * includes changed. The compiler writes the transitive inputs to
+ * `<binary>.d`, which is consulted on the next start.
+ *
+ * Concurrent starters serialize on an flock() of `<binary>.lock`; the new
+ * binary is compiled to a temp file and rename()d into place, so nobody
+ * ever execs a half-written binary.
+ *
+ * The rebuild is tuned for turnaround rather than speed of the script:
+ * -O0, a cached precompiled nob.hpp, the implementation prebuilt into
+ * .nob/libnob.a and the fastest linker available.
+ */
+void go_rebuild_urself(int argc, char** argv, fs::path source_path);
+
+/*
+ * Compiles the implementation part of `header` (nob.hpp) once into
+ * `<dir>/libnob.a`, recompiling only when it changes. Build scripts linked
+ * against it are compiled with -DNOB_IMPLEMENTATION_PREBUILT.
+ */
+std::optional<fs::path> build_libnob(const fs::path& header,
+                                     const fs::path& dir,
+                                     const std::vector<std::string>& flags = { "-O0" });
+
+/*
+ * Hot reloadable build logic. The build script is compiled to a shared
+ * object that exports
+ *
+ *     extern "C" int nob_main(int argc, char** argv);
+ *
+ * and a small, stable launcher dlopen()s it, calling it in-process and
+ * recompiling/reloading it only when its sources change:
+ *
+ *     // launcher.cpp, built once with `c++ -rdynamic launcher.cpp -o nob`
+ *     #define NOB_IMPLEMENTATION
+ *     #include "nob.hpp"
+ *     int main(int argc, char** argv)
+ *     {
+ *         nob::go_rebuild_urself(argc, argv, __FILE__);
+ *         return nob::go_hot_reload(argc, argv, "nob.cpp");
+ *     }
+ *
+ * The launcher holds the implementation: compiled in on bootstrap, linked
+ * from libnob.a by its self-rebuilds. The script only includes nob.hpp,
+ * without NOB_IMPLEMENTATION, so its references to nob functions bind to the
+ * launcher's copies (exported by -rdynamic) and their in-memory state
+ * survives reloads. Defining it there too would still work, but recompiles
+ * the whole implementation on every reload.
+ */
+class HotReload {
+public:
+    HotReload(fs::path source_path, fs::path dir = {});
+
+    ~HotReload();
+
+    HotReload(const HotReload&) = delete;
+    HotReload& operator=(const HotReload&) = delete;
+
+    /* Recompiles and reloads the shared object if its sources changed, returns false on failure */
+    bool reload_if_changed();
+
+    int run(int argc, char** argv);
+
+    /* Runs the script, then again every time its sources change, until it returns non-zero */
+    int watch(int argc, char** argv, std::chrono::milliseconds poll = std::chrono::milliseconds(200));
+
+private:
+    void unload();
+
+    fs::path m_source_path;
+    fs::path m_dir;
+    fs::path m_so_path;
+    fs::path m_depfile;
+    void* m_handle = nullptr;
+    int (*m_entry)(int, char**) = nullptr;
+};
+
+/* Runs the build logic of `source_path` as a hot reloaded shared object, see HotReload */
+int go_hot_reload(int argc, char** argv, fs::path source_path, bool watch = false);
+
+bool download(const std::string& url,
+              std::optional<fs::path> out = std::nullopt,
+              std::optional<Verbosity> v = std::nullopt);
+
+bool extract_tar_gz(const fs::path& archive,
+                    std::optional<fs::path> out = std::nullopt,
+                    std::optional<Verbosity> v = std::nullopt);
+
+bool extract_tar_bz2(const fs::path& archive,
+                     std::optional<fs::path> out = std::nullopt,
+                     std::optional<Verbosity> v = std::nullopt);
+
+bool extract_bz2(const fs::path& compressed,
+                 std::optional<fs::path> out = std::nullopt,
+                 std::optional<Verbosity> v = std::nullopt);
+
+bool extract_zip(const fs::path& archive,
+                 std::optional<fs::path> out = std::nullopt,
+                 std::optional<Verbosity> v = std::nullopt);
+
+bool extract_gz(const fs::path& compressed,
+                std::optional<fs::path> out = std::nullopt,
+                std::optional<Verbosity> v = std::nullopt);
+
+bool extract(const fs::path& in,
+             std::optional<fs::path> out = std::nullopt,
+             std::optional<Verbosity> v = std::nullopt);
+
+/* With `out`, the archive is downloaded into it as well, otherwise into the cwd */
+bool download_and_extract(const std::string& url,
+                          std::optional<fs::path> out = std::nullopt,
+                          std::optional<Verbosity> v = std::nullopt);
+
+}
+
+#endif /* NOB_HPP_ */
+
+#if defined(NOB_IMPLEMENTATION) && !defined(NOB_IMPLEMENTATION_PREBUILT) && !defined(NOB_IMPLEMENTATION_DONE_)
+#define NOB_IMPLEMENTATION_DONE_
+
+#include <fstream>
+/*
+ * For std::cout/std::cerr, mostly to flush them before writing to their fds
+ * directly, so output stays in order with the script's own. This means the
+ * implementation, and with it libnob.a, still runs the iostream static init;
+ * only the declarations part is iostream-free.
+ */
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <memory>
+#include <algorithm>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <sstream>
+#include <csignal>
+#include <dlfcn.h>
+#include <cstdlib>
+
+namespace {
+
+std::string get_executable_path()
+{
+    char buf[PATH_MAX] = {0};
+    ssize_t len = readlink("/proc/self/exe", buf, sizeof(buf) - 1);
+    if (len == -1) {
+        throw std::runtime_error("get_executable_path(): Failed to read /proc/self/exe");
+    }
+    buf[len] = '\0';
+
+    /* The binary may have been replaced by a concurrent go_rebuild_urself() */
+    std::string path(buf);
+    const std::string deleted = " (deleted)";
+    if (path.size() > deleted.size() && path.compare(path.size() - deleted.size(), deleted.size(), deleted) == 0) {
+        path.resize(path.size() - deleted.size());
+    }
+    return path;
+}
+
+}
+
+namespace nob {
+
+namespace detail {
+
+const char* log_prefix(LogLevel lvl)
+{
+    switch(lvl) {
+        case LogLevel::Info: return "\e[0;34m""[NOB INFO] ""\e[0m";
+        case LogLevel::Warning: return "\e[0;33m""[NOB WARNING] ""\e[0m";
+        case LogLevel::Error: return "\e[0;31m""[NOB ERROR] ""\e[0m";
+        default: return "\e[0;35m""[NOB UNKNOWN] ""\e[0m";
+    }
+}
+
+/* Same output as std::quoted(), which is what std::filesystem::path prints */
+void format_quoted(std::string& out, std::string_view s)
+{
+    out.push_back('"');
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out.push_back('\\');
+        }
+        out.push_back(c);
+    }
+    out.push_back('"');
+}
+
+bool write_all(int fd, const char* data, std::size_t size)
+{
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+std::string_view trim(std::string_view s)
+{
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+        s.remove_prefix(1);
+    }
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+        s.remove_suffix(1);
+    }
+    return s;
+}
+
+/* A whole number in `base`, nothing else but surrounding blanks; unsigned types reject a sign */
+template<typename T = std::size_t>
+std::optional<T> parse_int(std::string_view s, int base = 10)
+{
+    s = trim(s);
+    T value;
+    auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), value, base);
+    if (s.empty() || ec != std::errc() || end != s.data() + s.size()) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+/*
+ * Bounded multi-producer ring (Vyukov's sequence-numbered slots), drained by
+ * a single flusher thread. Producers only ever contend on one atomic.
+ */
+class AsyncLog {
+public:
+    void start(AsyncLogOptions options)
+    {
+        std::size_t capacity = 1;
+        while (capacity < std::max<std::size_t>(options.capacity, 2)) {
+            capacity <<= 1;
+        }
+        m_slots = std::vector<Slot>(capacity);
+        for (std::size_t i = 0; i < capacity; i++) {
+            m_slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+        m_mask = capacity - 1;
+        m_head.store(0);
+        m_tail = 0;
+        m_overflow = options.overflow;
+
+        m_file_fd = -1;
+        if (options.file) {
+            m_file_fd = open(options.file->c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (m_file_fd == -1) {
+                write_all(STDERR_FILENO, "enable_async_log(): Could not open log file\n", 44);
+            }
+        }
+
+        m_stop = false;
+        m_closed.store(false);
+        m_thread = std::thread([this] { drain_loop(); });
+        enabled.store(true, std::memory_order_release);
+    }
+
+    void stop()
+    {
+        if (!enabled.exchange(false)) {
+            return;
+        }
+        /* Producers that got past `enabled` either see this and write directly, or are waited for */
+        m_closed.store(true);
+        while (m_producers.load() != 0) {
+            std::this_thread::yield();
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            m_stop = true;
+        }
+        m_cv.notify_one();
+        m_thread.join();
+        if (m_file_fd != -1) {
+            close(m_file_fd);
+        }
+    }
+
+    /* Returns false once stop() has begun, the caller writes the line itself then */
+    bool push(int fd, const std::string& line)
+    {
+        m_producers.fetch_add(1);
+        if (m_closed.load()) {
+            m_producers.fetch_sub(1);
+            return false;
+        }
+        enqueue(fd, line);
+        m_producers.fetch_sub(1, std::memory_order_release);
+        return true;
+    }
+
+    std::atomic<bool> enabled { false };
+    std::atomic<std::size_t> dropped { 0 };
+
+private:
+    struct Slot {
+        std::atomic<std::size_t> seq;
+        int fd;
+        std::string line;
+    };
+
+    void enqueue(int fd, const std::string& line)
+    {
+        for (;;) {
+            std::size_t pos = m_head.load(std::memory_order_relaxed);
+            Slot& slot = m_slots[pos & m_mask];
+            std::size_t seq = slot.seq.load(std::memory_order_acquire);
+            if (seq == pos) {
+                if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    slot.fd = fd;
+                    slot.line = line;
+                    slot.seq.store(pos + 1, std::memory_order_release);
+                    if (m_sleeping.load(std::memory_order_acquire)) {
+                        m_cv.notify_one();
+                    }
+                    return;
+                }
+            } else if (seq < pos + 1) {
+                /* Full */
+                if (m_overflow == LogOverflow::Drop) {
+                    dropped.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+                m_cv.notify_one();
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    bool pop(int& fd, std::string& line)
+    {
+        Slot& slot = m_slots[m_tail & m_mask];
+        if (slot.seq.load(std::memory_order_acquire) != m_tail + 1) {
+            return false;
+        }
+        fd = slot.fd;
+        line.swap(slot.line);
+        slot.seq.store(m_tail + m_mask + 1, std::memory_order_release);
+        m_tail++;
+        return true;
+    }
+
+    void drain_loop()
+    {
+        std::string out, err, line;
+        for (;;) {
+            int fd;
+            while (pop(fd, line)) {
+                (fd == STDERR_FILENO ? err : out) += line;
+                if (out.size() + err.size() > (1 << 16)) {
+                    break;
+                }
+            }
+
+            if (out.empty() && err.empty()) {
+                std::unique_lock<std::mutex> lock(m_mtx);
+                if (m_stop && m_head.load() == m_tail) {
+                    return;
+                }
+                m_sleeping.store(true, std::memory_order_release);
+                m_cv.wait_for(lock, std::chrono::milliseconds(10));
+                m_sleeping.store(false, std::memory_order_release);
+                continue;
+            }
+
+            /* One write() per stream for the whole batch */
+            write_all(STDOUT_FILENO, out.data(), out.size());
+            write_all(STDERR_FILENO, err.data(), err.size());
+            if (m_file_fd != -1) {
+                std::string plain = strip_colors(out + err);
+                write_all(m_file_fd, plain.data(), plain.size());
+            }
+            out.clear();
+            err.clear();
+        }
+    }
+
+    static std::string strip_colors(const std::string& s)
+    {
+        std::string plain;
+        for (std::size_t i = 0; i < s.size(); i++) {
+            if (s[i] == '\e') {
+                std::size_t end = s.find('m', i);
+                if (end != std::string::npos) {
+                    i = end;
+                    continue;
+                }
+            }
+            plain += s[i];
+        }
+        return plain;
+    }
+
+    std::vector<Slot> m_slots;
+    std::size_t m_mask = 0;
+    std::atomic<std::size_t> m_head { 0 };
+    std::size_t m_tail = 0; /* only touched by the flusher */
+    LogOverflow m_overflow = LogOverflow::Block;
+    int m_file_fd = -1;
+
+    std::thread m_thread;
+    std::mutex m_mtx;
+    std::condition_variable m_cv;
+    std::atomic<bool> m_sleeping { false };
+    bool m_stop = false;
+    std::atomic<bool> m_closed { false };
+    std::atomic<std::size_t> m_producers { 0 };
+};
+
+AsyncLog& async_log()
+{
+    static AsyncLog log;
+    return log;
+}
+
+std::string& log_buffer()
+{
+    thread_local std::string line;
+    return line;
+}
+
+/* The line a Progress keeps at the bottom of the terminal */
+struct StatusLine {
+    std::atomic<bool> active { false };   /* drawn on a terminal */
+    std::atomic<bool> quiet_cmds { false }; /* a Progress reports jobs, don't echo commands */
+    std::mutex mtx;                         /* held for every Progress write, drawn or not */
+    std::string text;
+};
+
+StatusLine& status_line()
+{
+    static StatusLine line;
+    return line;
+}
+
+/* Prints `text` above the status line in one write, false if there is none */
+bool write_above_status(const std::string& text)
+{
+    auto& status = status_line();
+    if (!status.active.load(std::memory_order_acquire)) {
+        return false;
+    }
+    std::cout.flush();
+    std::lock_guard<std::mutex> lock(status.mtx);
+    std::string out = "\r\e[K" + text + status.text;
+    write_all(STDOUT_FILENO, out.data(), out.size());
+    return true;
+}
+
+struct EventLog {
+    int fd = -1;
+    bool owns_fd = false;
+    bool replace_log = false;
+};
+
+EventLog& event_log()
+{
+    static EventLog log;
+    return log;
+}
+
+void json_string(std::string& out, std::string_view s)
+{
+    static const char hex[] = "0123456789abcdef";
+    out.push_back('"');
+    for (char c : s) {
+        switch (c) {
+            case '"': out.append("\\\""); break;
+            case '\\': out.append("\\\\"); break;
+            case '\n': out.append("\\n"); break;
+            case '\r': out.append("\\r"); break;
+            case '\t': out.append("\\t"); break;
+            default: {
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    out.append("\\u00");
+                    out.push_back(hex[(c >> 4) & 0xf]);
+                    out.push_back(hex[c & 0xf]);
+                } else {
+                    out.push_back(c);
+                }
+            } break;
+        }
+    }
+    out.push_back('"');
+}
+
+void event_write(const std::string& line)
+{
+    /* One write() per line: with O_APPEND, concurrent events never interleave */
+    int fd = event_log().fd;
+    if (fd != -1) {
+        write_all(fd, line.data(), line.size());
+    }
+}
+
+/* Waits for `pid` started at `start` for `cmd`, reporting a cmd_finish event */
+int wait_cmd(pid_t pid, const Cmd& cmd, std::chrono::steady_clock::time_point start)
+{
+    int status = 0;
+    struct rusage usage {};
+    while (wait4(pid, &status, 0, &usage) == -1) {
+        if (errno != EINTR) {
+            throw std::runtime_error("wait4() failed: " + std::string(std::strerror(errno)));
+        }
+    }
+
+    if (event_log_enabled()) {
+        auto ms = [](const timeval& tv) { return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0; };
+        Event event("cmd_finish");
+        event.field("pid", pid).field("argv", cmd.args());
+        if (WIFEXITED(status)) {
+            event.field("exit_code", WEXITSTATUS(status));
+        } else if (WIFSIGNALED(status)) {
+            event.field("signal", WTERMSIG(status));
+        }
+        event.field("duration_ms", std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count())
+             .field("user_ms", ms(usage.ru_utime))
+             .field("sys_ms", ms(usage.ru_stime))
+             .field("max_rss_kb", usage.ru_maxrss)
+             .emit();
+    }
+    return status;
+}
+
+void cmd_start_event(pid_t pid, const Cmd& cmd)
+{
+    if (event_log_enabled()) {
+        Event("cmd_start").field("pid", pid).field("argv", cmd.args()).field("wd", cmd.wd()).emit();
+    }
+}
+
+void log_write(int fd, LogLevel lvl, const std::string& line)
+{
+    if (event_log_enabled()) {
+        std::string_view message(line);
+        message.remove_prefix(std::strlen(log_prefix(lvl)));
+        message.remove_suffix(1);
+        const char* level = lvl == LogLevel::Error ? "error" : lvl == LogLevel::Warning ? "warning" : "info";
+        Event("log").field("level", level).field("message", message).emit();
+        if (event_log().replace_log) {
+            return;
+        }
+    }
+
+    if (write_above_status(line)) {
+        return;
+    }
+
+    /* Keep ordering with whatever the script already printed through the stream */
+    (fd == STDERR_FILENO ? std::cerr : std::cout).flush();
+    if (!async_log().enabled.load(std::memory_order_acquire) || !async_log().push(fd, line)) {
+        write_all(fd, line.data(), line.size());
+    }
+}
+
+void log_write(std::ostream& out, LogLevel lvl, const std::string& line)
+{
+    if (&out == &std::cout) {
+        log_write(STDOUT_FILENO, lvl, line);
+        return;
+    } else if (&out == &std::cerr) {
+        log_write(STDERR_FILENO, lvl, line);
+        return;
+    }
+
+    /* Any other stream: striped locks, so unrelated streams rarely share one */
+    static std::mutex locks[16];
+    std::lock_guard<std::mutex> lock(locks[std::hash<const void*>{}(&out) % 16]);
+    out.write(line.data(), line.size());
+    out.flush();
+}
+
+}
+
+void set_log_level(LogLevel lvl)
+{
+    detail::runtime_log_level.store(static_cast<int>(lvl), std::memory_order_relaxed);
+}
+
+void parse_log_flags(int& argc, char** argv)
+{
+    int kept = 0;
+    for (int i = 0; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i > 0 && arg == "--quiet") {
+            set_log_level(LogLevel::Warning);
+        } else if (i > 0 && arg == "--silent") {
+            set_log_level(LogLevel::Error);
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    argv[kept] = nullptr;
+    argc = kept;
+}
+
+void enable_async_log(AsyncLogOptions options)
+{
+    static bool registered = false;
+    if (detail::async_log().enabled) {
+        return;
+    }
+    if (!registered) {
+        std::atexit(disable_async_log);
+        registered = true;
+    }
+    detail::async_log().start(std::move(options));
+}
+
+void disable_async_log()
+{
+    detail::async_log().stop();
+}
+
+std::size_t dropped_log_records()
+{
+    return detail::async_log().dropped.load();
+}
+
+bool enable_event_log(EventLogOptions options)
+{
+    disable_event_log();
+
+    auto& log = detail::event_log();
+    if (options.file) {
+        log.fd = open(options.file->c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (log.fd == -1) {
+            error("Could not open event log ", *options.file, ": ", std::strerror(errno));
+            return false;
+        }
+        log.owns_fd = true;
+    } else if (options.fd != -1) {
+        log.fd = options.fd;
+        log.owns_fd = false;
+    } else {
+        error("enable_event_log(): neither a file nor an fd was given");
+        return false;
+    }
+    log.replace_log = options.replace_log;
+    detail::event_log_on.store(true, std::memory_order_release);
+    return true;
+}
+
+void disable_event_log()
+{
+    auto& log = detail::event_log();
+    detail::event_log_on.store(false, std::memory_order_release);
+    if (log.owns_fd) {
+        close(log.fd);
+    }
+    log = detail::EventLog {};
+}
+
+Event::Event(std::string_view name)
+{
+    auto ts = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    m_line.append("{\"ts\":");
+    detail::format_number(m_line, ts);
+    m_line.append(",\"event\":");
+    detail::json_string(m_line, name);
+}
+
+void Event::emit()
+{
+    if (!event_log_enabled()) {
+        return;
+    }
+    m_line.append("}\n");
+    detail::event_write(m_line);
+    m_line.pop_back();
+    m_line.pop_back();
+}
+
+namespace detail {
+
+class StatCache {
+public:
+    std::optional<FileStat> get(const std::string& key)
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        auto it = m_stats.find(key);
+        if (it == m_stats.end()) {
+            return std::nullopt;
+        }
+        return it->second;
+    }
+
+    void put(const std::string& key, const FileStat& st)
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_stats[key] = st;
+    }
+
+    void invalidate(const std::string& key)
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        if (key.empty()) {
+            m_stats.clear();
+            m_cwd.clear();
+            return;
+        }
+        m_stats.erase(key);
+        /* Everything below `key` sorts in one run starting at "key/" */
+        std::string below = key.back() == '/' ? key : key + '/';
+        auto first = m_stats.lower_bound(below);
+        auto last = first;
+        while (last != m_stats.end() && last->first.compare(0, below.size(), below) == 0) {
+            ++last;
+        }
+        m_stats.erase(first, last);
+
+        /*
+         * The parent's mtime changed, and create_directories() and friends
+         * may have created ancestors cached as missing: drop those up to and
+         * including the first one that existed.
+         */
+        std::string_view ancestor(key);
+        while (ancestor.size() > 1) {
+            auto slash = ancestor.find_last_of('/');
+            if (slash == std::string_view::npos) {
+                break;
+            }
+            ancestor = ancestor.substr(0, slash == 0 ? 1 : slash);
+            auto it = m_stats.find(std::string(ancestor));
+            if (it == m_stats.end()) {
+                continue;
+            }
+            bool existed = it->second.exists;
+            m_stats.erase(it);
+            if (existed) {
+                break;
+            }
+        }
+    }
+
+    /* Absolute and normalized, so "a/../b" and "./b" share an entry; the cwd is asked once */
+    std::string key(const fs::path& path)
+    {
+        const std::string& native = path.native();
+        std::string key;
+        if (path.is_absolute()) {
+            key = native;
+        } else {
+            {
+                std::lock_guard<std::mutex> lock(m_mtx);
+                if (m_cwd.empty()) {
+                    m_cwd = fs::current_path().string();
+                }
+                key = m_cwd;
+            }
+            key.push_back('/');
+            key.append(native);
+        }
+
+        /* lexically_normal() is slow, most paths don't need it */
+        if (key.find("//") != std::string::npos || key.find("/.") != std::string::npos) {
+            key = fs::path(key).lexically_normal().string();
+        }
+        if (key.size() > 1 && key.back() == '/') {
+            key.pop_back();
+        }
+        return key;
+    }
+
+private:
+    std::map<std::string, FileStat> m_stats; /* ordered, to drop whole subtrees at once */
+    std::string m_cwd;
+    std::mutex m_mtx;
+};
+
+StatCache& stat_cache()
+{
+    static StatCache cache;
+    return cache;
+}
+
+FileStat stat_uncached(const fs::path& path)
+{
+    FileStat result;
+    struct statx stx;
+    if (statx(AT_FDCWD, path.c_str(), AT_STATX_DONT_SYNC, STATX_TYPE | STATX_SIZE | STATX_MTIME, &stx) == 0) {
+        result.exists = true;
+        result.is_dir = S_ISDIR(stx.stx_mode);
+        result.size = stx.stx_size;
+        result.mtime = static_cast<std::int64_t>(stx.stx_mtime.tv_sec) * 1000000000 + stx.stx_mtime.tv_nsec;
+    }
+    return result;
+}
+
+}
+
+FileStat stat_cached(const fs::path& path)
+{
+    auto& cache = detail::stat_cache();
+    std::string key = cache.key(path);
+    if (auto st = cache.get(key)) {
+        return *st;
+    }
+    FileStat st = detail::stat_uncached(path);
+    cache.put(key, st);
+    return st;
+}
+
+void prefetch_stats(const std::vector<fs::path>& paths, std::size_t jobs)
+{
+    auto& cache = detail::stat_cache();
+    jobs = std::max<std::size_t>(std::min(jobs, paths.size() / 64), 1);
+    std::atomic<std::size_t> next { 0 };
+    auto worker = [&]() {
+        for (std::size_t i; (i = next++) < paths.size();) {
+            cache.put(cache.key(paths[i]), detail::stat_uncached(paths[i]));
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (std::size_t i = 1; i < jobs; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+void invalidate_stats(const fs::path& path)
+{
+    auto& cache = detail::stat_cache();
+    cache.invalidate(path.empty() ? std::string() : cache.key(path));
+}
+
+namespace detail {
+
+/* A name next to `path` to build it under before rename()ing it over, unique across processes and threads */
+fs::path temp_path(const fs::path& path)
+{
+    static std::atomic<std::uint64_t> counter { 0 };
+    fs::path tmp = path;
+    tmp += ".nob_tmp." + std::to_string(getpid()) + "." + std::to_string(counter++);
+    return tmp;
+}
+
+/* Replaces `path` with `data` through a temp file, readers see either the old or the new contents */
+bool atomic_write(const fs::path& path, std::string_view data, mode_t mode = 0644)
+{
+    if (path.has_parent_path()) {
+        std::error_code ec;
+        fs::create_directories(path.parent_path(), ec);
+    }
+    fs::path tmp = temp_path(path);
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+    if (fd == -1) {
+        error("Could not create ", tmp, ": ", std::strerror(errno));
+        return false;
+    }
+    bool written = write_all(fd, data.data(), data.size());
+    written = close(fd) == 0 && written;
+    if (!written || rename(tmp.c_str(), path.c_str()) == -1) {
+        error("Could not write ", path, ": ", std::strerror(errno));
+        unlink(tmp.c_str());
+        return false;
+    }
+    invalidate_stats(path);
+    return true;
+}
+
+}
+
+bool mkdir(const fs::path& path)
+{
+    FileStat st = stat_cached(path);
+    if (st.exists) {
+        if (st.is_dir) {
+            info(path, " already exists, not creating");
+            return true;
+        }
+
+        error(path, " already exists and is not a directory");
+        return false;
+    }
+
+    bool created = fs::create_directories(path);
+    invalidate_stats(path);
+    return created;
+}
+
+void remove(const fs::path& path)
+{
+    warning("Removing ", path);
+    /* TODO: Ask for confirmation */
+    fs::remove(path);
+    invalidate_stats(path);
+}
+
+namespace detail {
+
+struct LinuxDirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/*
+ * Parallel rm -rf. Every directory is a node that counts its unfinished
+ * parts: its own scan plus one per subdirectory. Whoever drops a count to
+ * zero removes that directory and reports to its parent, whose fd stays
+ * open until then, so no path is ever resolved twice.
+ */
+class TreeRemover {
+public:
+    explicit TreeRemover(std::size_t jobs)
+        : m_jobs(std::max<std::size_t>(jobs, 1))
+    {
+    }
+
+    void run(const fs::path& root)
+    {
+        auto node = std::make_unique<Node>();
+        node->parent = nullptr;
+        node->parent_fd = AT_FDCWD;
+        node->name = root.string();
+        node->path = root;
+        m_stack.push_back(node.get());
+        m_nodes.push_back(std::move(node));
+
+        std::vector<std::thread> threads;
+        for (std::size_t i = 1; i < m_jobs; i++) {
+            threads.emplace_back([this]() { work(); });
+        }
+        work();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+private:
+    struct Node {
+        Node* parent;
+        int parent_fd;
+        std::string name; /* relative to parent_fd */
+        fs::path path;    /* for messages and the fallback */
+        int fd = -1;
+        std::atomic<std::size_t> pending { 1 };
+    };
+
+    void work()
+    {
+        for (;;) {
+            Node* node;
+            {
+                std::unique_lock<std::mutex> lock(m_mtx);
+                m_cv.wait(lock, [this]() { return !m_stack.empty() || m_done; });
+                if (m_stack.empty()) {
+                    return;
+                }
+                /* LIFO goes depth first, which keeps the number of open parent fds low */
+                node = m_stack.back();
+                m_stack.pop_back();
+            }
+            scan(node);
+        }
+    }
+
+    void scan(Node* node)
+    {
+        node->fd = openat(node->parent_fd, node->name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (node->fd == -1) {
+            /* Out of fds or something odd: let the standard library deal with this subtree */
+            std::error_code ec;
+            fs::remove_all(node->path, ec);
+            if (ec) {
+                error("Could not remove ", node->path, ": ", ec.message());
+            }
+            node->pending = 0;
+            report(node->parent);
+            return;
+        }
+
+        alignas(LinuxDirent64) char buffer[64 * 1024];
+        for (;;) {
+            long n = syscall(SYS_getdents64, node->fd, buffer, sizeof(buffer));
+            if (n <= 0) {
+                break;
+            }
+            for (long offset = 0; offset < n;) {
+                auto* entry = reinterpret_cast<LinuxDirent64*>(buffer + offset);
+                offset += entry->d_reclen;
+
+                const char* name = entry->d_name;
+                if (std::strcmp(name, ".") == 0 || std::strcmp(name, "..") == 0) {
+                    continue;
+                }
+
+                bool is_dir = entry->d_type == DT_DIR;
+                if (entry->d_type == DT_UNKNOWN) {
+                    struct stat st;
+                    is_dir = fstatat(node->fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+                }
+
+                if (!is_dir) {
+                    if (unlinkat(node->fd, name, 0) == -1 && errno != ENOENT) {
+                        error("Could not remove ", node->path / name, ": ", std::strerror(errno));
+                    }
+                    continue;
+                }
+
+                auto child = std::make_unique<Node>();
+                child->parent = node;
+                child->parent_fd = node->fd;
+                child->name = name;
+                child->path = node->path / name;
+                node->pending++;
+                {
+                    std::lock_guard<std::mutex> lock(m_mtx);
+                    m_stack.push_back(child.get());
+                    m_nodes.push_back(std::move(child));
+                }
+                m_cv.notify_one();
+            }
+        }
+        report(node);
+    }
+
+    /* One part of `node` is done; remove it and walk up while that finishes parents too */
+    void report(Node* node)
+    {
+        while (node != nullptr && --node->pending == 0) {
+            close(node->fd);
+            if (unlinkat(node->parent_fd, node->name.c_str(), AT_REMOVEDIR) == -1 && errno != ENOENT) {
+                error("Could not remove ", node->path, ": ", std::strerror(errno));
+            }
+            node = node->parent;
+        }
+        if (node == nullptr) {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            m_done = true;
+            m_cv.notify_all();
+        }
+    }
+
+    std::size_t m_jobs;
+    std::vector<Node*> m_stack;
+    std::vector<std::unique_ptr<Node>> m_nodes;
+    bool m_done = false;
+    std::mutex m_mtx;
+    std::condition_variable m_cv;
+};
+
+/* Double fork, so the deletion outlives us and never becomes our zombie */
+bool remove_detached(const fs::path& path)
+{
+    std::string target = path.string();
+    pid_t pid = fork();
+    if (pid < 0) {
+        return false;
+    } else if (pid == 0) {
+        /* Only async-signal-safe calls from here on, other threads may hold locks */
+        if (fork() != 0) {
+            _exit(0);
+        }
+        setsid();
+        int null = open("/dev/null", O_RDWR);
+        if (null != -1) {
+            dup2(null, STDIN_FILENO);
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+        execlp("rm", "rm", "-rf", "--", target.c_str(), static_cast<char*>(nullptr));
+        _exit(1);
+    }
+    waitpid(pid, nullptr, 0);
+    return true;
+}
+
+}
+
+void remove_recursive(const fs::path& path, RemoveMode mode, std::size_t jobs)
+{
+    warning("Removing recursively ", path);
+    /* TODO: Ask for confirmation */
+    struct stat st;
+    if (lstat(path.c_str(), &st) == -1) {
+        return;
+    }
+    invalidate_stats(path);
+    if (!S_ISDIR(st.st_mode)) {
+        fs::remove(path);
+        return;
+    }
+
+    if (mode == RemoveMode::Background) {
+        static std::atomic<unsigned> counter { 0 };
+        fs::path trash = path.has_filename() ? path : path.parent_path();
+        trash += ".nob_trash." + std::to_string(getpid()) + "." + std::to_string(counter++);
+        std::error_code ec;
+        fs::rename(path, trash, ec);
+        if (!ec && detail::remove_detached(trash)) {
+            return;
+        }
+        if (!ec) {
+            fs::rename(trash, path, ec);
+        }
+        warning("Could not remove ", path, " in the background, removing it now");
+    }
+
+    detail::TreeRemover(jobs).run(path);
+}
+
+namespace detail {
+
+/* What getdents64() said about a directory, kept while its mtime doesn't change */
+struct DirListing {
+    std::int64_t mtime;
+    std::vector<std::pair<std::string, char>> entries; /* name, 'd'ir / 'f'ile / 'l'ink */
+};
+
+class DirCache {
+public:
+    std::optional<DirListing> get(const std::string& dir, std::int64_t mtime)
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        load_locked();
+        m_seen.insert(dir);
+        auto it = m_dirs.find(dir);
+        if (it == m_dirs.end() || it->second.mtime != mtime) {
+            return std::nullopt;
+        }
+        return it->second;
+    }
+
+    void put(const std::string& dir, DirListing listing)
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        load_locked();
+        m_seen.insert(dir);
+        m_dirs[dir] = std::move(listing);
+        m_dirty = true;
+    }
+
+    /*
+     * Drops the directories under `root` that no walk of this process has
+     * listed. After a `complete` walk those are gone, otherwise they may just
+     * have been filtered out and are only dropped if they no longer exist.
+     */
+    void prune(const std::string& root, bool complete)
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        load_locked();
+        std::string below = root.back() == '/' ? root : root + '/';
+        for (auto it = m_dirs.lower_bound(root); it != m_dirs.end();) {
+            if (it->first != root && it->first.compare(0, below.size(), below) != 0) {
+                if (it->first > below) {
+                    break;
+                }
+                ++it;
+                continue;
+            }
+            struct stat st;
+            if (m_seen.count(it->first) == 0
+                && (complete || stat(it->first.c_str(), &st) == -1 || !S_ISDIR(st.st_mode))) {
+                it = m_dirs.erase(it);
+                m_dirty = true;
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void save()
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        if (!m_dirty) {
+            return;
+        }
+        std::string out;
+        for (const auto& [dir, listing] : m_dirs) {
+            out += dir + '\t' + std::to_string(listing.mtime) + '\t' + std::to_string(listing.entries.size()) + '\n';
+            for (const auto& [name, type] : listing.entries) {
+                out += type;
+                out += name;
+                out += '\n';
+            }
+        }
+        if (atomic_write(m_file, out)) {
+            m_dirty = false;
+        }
+    }
+
+private:
+    void load_locked()
+    {
+        if (m_loaded) {
+            return;
+        }
+        m_loaded = true;
+        std::ifstream in(m_file);
+        std::string line;
+        while (std::getline(in, line)) {
+            auto tab1 = line.find('\t');
+            auto tab2 = tab1 == std::string::npos ? tab1 : line.find('\t', tab1 + 1);
+            std::optional<std::int64_t> mtime;
+            std::optional<std::size_t> count;
+            if (tab2 != std::string::npos) {
+                mtime = parse_int<std::int64_t>(std::string_view(line).substr(tab1 + 1, tab2 - tab1 - 1));
+                count = parse_int(std::string_view(line).substr(tab2 + 1));
+            }
+            if (!mtime || !count) {
+                return discard_locked();
+            }
+            std::string dir = line.substr(0, tab1);
+            DirListing listing { *mtime, {} };
+            for (std::size_t i = 0; i < *count; i++) {
+                if (!std::getline(in, line) || line.size() < 2) {
+                    return discard_locked();
+                }
+                listing.entries.emplace_back(line.substr(1), line[0]);
+            }
+            m_dirs[dir] = std::move(listing);
+        }
+    }
+
+    /* A truncated or corrupt file is a miss for everything, it gets rewritten on the next save() */
+    void discard_locked()
+    {
+        m_dirs.clear();
+        m_dirty = true;
+    }
+
+    fs::path m_file = fs::path(".nob") / "dircache";
+    std::map<std::string, DirListing> m_dirs;
+    std::set<std::string> m_seen;
+    bool m_loaded = false;
+    bool m_dirty = false;
+    std::mutex m_mtx;
+};
+
+
+DirCache& dir_cache()
+{
+    static DirCache cache;
+    return cache;
+}
+
+std::int64_t mtime_ns(const struct stat& st)
+{
+    return static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+/* Lists one directory, from the cache when its mtime says nothing changed */
+std::optional<DirListing> list_dir(const fs::path& dir)
+{
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return std::nullopt;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return std::nullopt;
+    }
+
+    std::string key = fs::absolute(dir).lexically_normal().string();
+    std::int64_t mtime = mtime_ns(st);
+    if (auto cached = dir_cache().get(key, mtime)) {
+        close(fd);
+        return cached;
+    }
+
+    DirListing listing { mtime, {} };
+    bool cacheable = key.find_first_of("\t\n") == std::string::npos;
+    alignas(LinuxDirent64) char buffer[64 * 1024];
+    for (;;) {
+        long n = syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+        if (n <= 0) {
+            break;
+        }
+        for (long offset = 0; offset < n;) {
+            auto* entry = reinterpret_cast<LinuxDirent64*>(buffer + offset);
+            offset += entry->d_reclen;
+
+            const char* name = entry->d_name;
+            if (std::strcmp(name, ".") == 0 || std::strcmp(name, "..") == 0) {
+                continue;
+            }
+
+            unsigned char type = entry->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat entry_st;
+                if (fstatat(fd, name, &entry_st, AT_SYMLINK_NOFOLLOW) == 0) {
+                    type = S_ISDIR(entry_st.st_mode) ? DT_DIR : S_ISLNK(entry_st.st_mode) ? DT_LNK : DT_REG;
+                }
+            }
+            if (std::strchr(name, '\n') != nullptr) {
+                cacheable = false;
+            }
+            listing.entries.emplace_back(name, type == DT_DIR ? 'd' : type == DT_LNK ? 'l' : 'f');
+        }
+    }
+    close(fd);
+
+    /* Changed within the mtime granularity of now: a later change might keep the same mtime */
+    auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    if (cacheable && now - mtime > 2000000000LL) {
+        dir_cache().put(key, listing);
+    }
+    return listing;
+}
+
+}
+
+std::vector<fs::path> walk(const fs::path& root, const WalkFilter& filter, std::size_t jobs)
+{
+    jobs = std::max<std::size_t>(jobs, 1);
+    std::vector<fs::path> stack = { root };
+    std::size_t busy = 0;
+    std::vector<fs::path> result;
+    std::mutex mtx;
+    std::condition_variable cv;
+
+    auto worker = [&]() {
+        std::vector<fs::path> found;
+        std::unique_lock<std::mutex> lock(mtx);
+        for (;;) {
+            cv.wait(lock, [&]() { return !stack.empty() || busy == 0; });
+            if (stack.empty()) {
+                break;
+            }
+            fs::path dir = std::move(stack.back());
+            stack.pop_back();
+            busy++;
+            lock.unlock();
+
+            std::vector<fs::path> subdirs;
+            std::string prefix = dir.native();
+            if (!prefix.empty() && prefix.back() != '/') {
+                prefix.push_back('/');
+            }
+            if (auto listing = detail::list_dir(dir)) {
+                for (const auto& [name, type] : listing->entries) {
+                    fs::path path = prefix + name;
+                    bool is_dir = type == 'd';
+                    if (type == 'l') {
+                        /* Links count as what they point to, but directories behind them aren't entered */
+                        if (stat_cached(path).is_dir) {
+                            continue;
+                        }
+                    }
+                    if (filter && !filter(path, is_dir)) {
+                        continue;
+                    }
+                    if (is_dir) {
+                        subdirs.push_back(std::move(path));
+                    } else {
+                        found.push_back(std::move(path));
+                    }
+                }
+            }
+
+            lock.lock();
+            busy--;
+            for (auto& subdir : subdirs) {
+                stack.push_back(std::move(subdir));
+            }
+            cv.notify_all();
+        }
+        result.insert(result.end(), std::make_move_iterator(found.begin()), std::make_move_iterator(found.end()));
+        cv.notify_all();
+    };
+
+    std::vector<std::thread> threads;
+    for (std::size_t i = 1; i < jobs; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    /* Keeps the cache from growing without bound as directories come and go */
+    std::string key = fs::absolute(root).lexically_normal().string();
+    if (key.size() > 1 && key.back() == '/') {
+        key.pop_back();
+    }
+    detail::dir_cache().prune(key, !filter);
+    detail::dir_cache().save();
+    /* Plain string order: path's operator< compares component by component, far slower */
+    std::sort(result.begin(), result.end(), [](const fs::path& a, const fs::path& b) {
+        return a.native() < b.native();
+    });
+    return result;
+}
+
+namespace detail {
+
+/* Matches `c` against the "[...]" starting at pattern[p], moving `p` past it */
+bool glob_class(std::string_view pattern, std::size_t& p, char c)
+{
+    std::size_t i = p + 1;
+    bool negate = i < pattern.size() && (pattern[i] == '!' || pattern[i] == '^');
+    if (negate) {
+        i++;
+    }
+    bool found = false;
+    for (std::size_t first = i; i < pattern.size() && (pattern[i] != ']' || i == first); i++) {
+        if (i + 2 < pattern.size() && pattern[i + 1] == '-' && pattern[i + 2] != ']') {
+            found = found || (pattern[i] <= c && c <= pattern[i + 2]);
+            i += 2;
+        } else {
+            found = found || pattern[i] == c;
+        }
+    }
+    if (i >= pattern.size()) {
+        /* No closing bracket, so it's a plain '[' */
+        p++;
+        return c == '[';
+    }
+    p = i + 1;
+    return found != negate;
+}
+
+/* fnmatch(pattern, name, FNM_PERIOD) for one component, minus the locale overhead */
+bool glob_component(std::string_view pattern, std::string_view name)
+{
+    if (!name.empty() && name[0] == '.' && (pattern.empty() || pattern[0] != '.')) {
+        return false;
+    }
+
+    std::size_t p = 0;
+    std::size_t n = 0;
+    std::size_t star = std::string_view::npos;
+    std::size_t star_n = 0;
+    while (n < name.size()) {
+        if (p < pattern.size() && pattern[p] == '*') {
+            star = p++;
+            star_n = n;
+            continue;
+        }
+        if (p < pattern.size()) {
+            std::size_t next = p + 1;
+            bool ok;
+            if (pattern[p] == '?') {
+                ok = true;
+            } else if (pattern[p] == '[') {
+                next = p;
+                ok = glob_class(pattern, next, name[n]);
+            } else {
+                if (pattern[p] == '\\' && p + 1 < pattern.size()) {
+                    next = ++p + 1;
+                }
+                ok = pattern[p] == name[n];
+            }
+            if (ok) {
+                p = next;
+                n++;
+                continue;
+            }
+        }
+        /* Mismatch: let the last '*' swallow one more character */
+        if (star == std::string_view::npos) {
+            return false;
+        }
+        p = star + 1;
+        n = ++star_n;
+    }
+    while (p < pattern.size() && pattern[p] == '*') {
+        p++;
+    }
+    return p == pattern.size();
+}
+
+/*
+ * Whether the components `path[si..]` match `pattern[pi..]`. With `prefix`,
+ * whether some path below `path` still could, i.e. it's worth descending.
+ */
+bool glob_match(const std::vector<std::string>& pattern, std::size_t pi,
+                const std::vector<std::string_view>& path, std::size_t si, bool prefix)
+{
+    if (si == path.size()) {
+        if (prefix) {
+            return pi < pattern.size();
+        }
+        while (pi < pattern.size() && pattern[pi] == "**") {
+            pi++;
+        }
+        return pi == pattern.size();
+    }
+    if (pi == pattern.size()) {
+        return false;
+    }
+    if (pattern[pi] == "**") {
+        return glob_match(pattern, pi + 1, path, si, prefix)
+            || (path[si].substr(0, 1) != "." && glob_match(pattern, pi, path, si + 1, prefix));
+    }
+    return glob_component(pattern[pi], path[si])
+        && glob_match(pattern, pi + 1, path, si + 1, prefix);
+}
+
+std::vector<std::string> components(const fs::path& path)
+{
+    std::vector<std::string> parts;
+    for (const auto& part : path) {
+        parts.push_back(part.string());
+    }
+    return parts;
+}
+
+}
+
+std::vector<fs::path> glob(const std::string& pattern)
+{
+    /* Walk from the longest directory prefix without wildcards */
+    fs::path root;
+    fs::path rest;
+    bool wild = false;
+    for (const auto& part : fs::path(pattern)) {
+        wild = wild || part.string().find_first_of("*?[") != std::string::npos;
+        (wild ? rest : root) /= part;
+    }
+
+    if (rest.empty()) {
+        return stat_cached(root).exists ? std::vector<fs::path> { root } : std::vector<fs::path> {};
+    }
+
+    std::vector<std::string> parts = detail::components(rest);
+    fs::path base = root.empty() ? fs::path(".") : root;
+    std::string prefix = base.native();
+    if (prefix.back() != '/') {
+        prefix.push_back('/');
+    }
+
+    /* walk() hands out base + '/' + relative path, split that without going through fs::path */
+    auto relative = [&](const fs::path& path, std::vector<std::string_view>& components) {
+        components.clear();
+        std::string_view native = path.native();
+        std::size_t start = prefix.size();
+        while (start <= native.size()) {
+            std::size_t end = std::min(native.find('/', start), native.size());
+            components.push_back(native.substr(start, end - start));
+            start = end + 1;
+        }
+    };
+
+    /* Directories are entered if some path below them could still match */
+    auto files = walk(base, [&](const fs::path& path, bool is_dir) {
+        thread_local std::vector<std::string_view> components;
+        relative(path, components);
+        return detail::glob_match(parts, 0, components, 0, is_dir);
+    });
+
+    if (root.empty()) {
+        for (auto& file : files) {
+            file = file.native().substr(prefix.size());
+        }
+    }
+    return files;
+}
+
+const char* to_string(CopyMethod m)
+{
+    switch (m) {
+        case CopyMethod::Reflink: return "reflink";
+        case CopyMethod::Hardlink: return "hardlink";
+        case CopyMethod::CopyFileRange: return "copy_file_range";
+        case CopyMethod::Copy: return "copy";
+    }
+    return "unknown";
+}
+
+std::ostream& operator<<(std::ostream& os, CopyMethod m)
+{
+    return os << to_string(m);
+}
+
+void format_to(std::string& out, CopyMethod m)
+{
+    out.append(to_string(m));
+}
+
+namespace detail {
+
+bool copy_fd_range(int in, int out, off_t size)
+{
+    off_t left = size;
+    while (left > 0) {
+        ssize_t n = copy_file_range(in, nullptr, out, nullptr, left, 0);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (n == 0) {
+            break;
+        }
+        left -= n;
+    }
+    return left == 0;
+}
+
+bool copy_fd_rw(int in, int out)
+{
+    if (lseek(in, 0, SEEK_SET) == -1 || lseek(out, 0, SEEK_SET) == -1 || ftruncate(out, 0) == -1) {
+        return false;
+    }
+
+    char buffer[1 << 16];
+    for (;;) {
+        ssize_t n = read(in, buffer, sizeof(buffer));
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (n == 0) {
+            return true;
+        }
+        if (!write_all(out, buffer, n)) {
+            return false;
+        }
+    }
+}
+
+/* Writes the contents of `from` into the already opened `to_fd` using `method`. */
+bool copy_contents(int from_fd, int to_fd, off_t size, CopyMethod method)
+{
+    switch (method) {
+        case CopyMethod::Reflink: return ioctl(to_fd, FICLONE, from_fd) == 0;
+        case CopyMethod::CopyFileRange: return copy_fd_range(from_fd, to_fd, size);
+        case CopyMethod::Copy: return copy_fd_rw(from_fd, to_fd);
+        default: return false;
+    }
+}
+
+/*
+ * Remembers, per (source fs, destination fs) pair, the methods the file
+ * systems don't support, so they aren't tried again for every file. Which
+ * one works first also depends on the call, e.g. whether hardlinks are allowed.
+ */
+struct CopyMethodCache {
+    std::mutex mtx;
+    std::map<std::pair<dev_t, dev_t>, unsigned> unsupported; /* bit per CopyMethod */
+};
+
+CopyMethodCache& copy_method_cache()
+{
+    static CopyMethodCache cache;
+    return cache;
+}
+
+bool copy_method_unsupported(dev_t from, dev_t to, CopyMethod method)
+{
+    auto& cache = copy_method_cache();
+    std::lock_guard<std::mutex> lock(cache.mtx);
+    auto it = cache.unsupported.find({from, to});
+    return it != cache.unsupported.end() && (it->second & (1u << static_cast<unsigned>(method)));
+}
+
+/* Only errors that hold for the whole file system, not e.g. ENOSPC or EMLINK */
+void copy_method_failed(dev_t from, dev_t to, CopyMethod method, int err)
+{
+    if (method == CopyMethod::Copy) {
+        return;
+    }
+    /* link() gives EPERM for files we don't own under fs.protected_hardlinks, others may still link */
+    if (method == CopyMethod::Hardlink && err == EPERM) {
+        return;
+    }
+    if (err != EOPNOTSUPP && err != ENOTSUP && err != EXDEV && err != EINVAL && err != EPERM && err != ENOSYS) {
+        return;
+    }
+    auto& cache = copy_method_cache();
+    std::lock_guard<std::mutex> lock(cache.mtx);
+    cache.unsupported[{from, to}] |= 1u << static_cast<unsigned>(method);
+}
+
+}
+
+std::optional<CopyMethod> materialize(const fs::path& from,
+                                      const fs::path& to,
+                                      bool allow_hardlink)
+{
+    int from_fd = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (from_fd == -1) {
+        error("materialize(): Could not open ", from, ": ", std::strerror(errno));
+        return std::nullopt;
+    }
+
+    struct stat from_st;
+    fstat(from_fd, &from_st);
+
+    if (to.has_parent_path()) {
+        fs::create_directories(to.parent_path());
+    }
+
+    struct stat dir_st;
+    if (stat(to.has_parent_path() ? to.parent_path().c_str() : ".", &dir_st) == -1) {
+        dir_st.st_dev = from_st.st_dev;
+    }
+
+    struct stat to_st;
+    if (allow_hardlink && lstat(to.c_str(), &to_st) == 0 && to_st.st_dev == from_st.st_dev && to_st.st_ino == from_st.st_ino) {
+        close(from_fd);
+        return CopyMethod::Hardlink;
+    }
+
+    /* Build next to the target and rename() over it, so readers never see a partial file */
+    fs::path tmp = detail::temp_path(to);
+
+    CopyMethod order[] = {
+        CopyMethod::Reflink,
+        CopyMethod::Hardlink,
+        CopyMethod::CopyFileRange,
+        CopyMethod::Copy,
+    };
+
+    std::optional<CopyMethod> used;
+    for (CopyMethod method : order) {
+        if (detail::copy_method_unsupported(from_st.st_dev, dir_st.st_dev, method)) {
+            continue;
+        }
+        if (method == CopyMethod::Hardlink) {
+            if (!allow_hardlink || from_st.st_dev != dir_st.st_dev) {
+                continue;
+            }
+            unlink(tmp.c_str());
+            if (link(from.c_str(), tmp.c_str()) == 0) {
+                used = method;
+                break;
+            }
+            detail::copy_method_failed(from_st.st_dev, dir_st.st_dev, method, errno);
+            continue;
+        }
+
+        int to_fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, from_st.st_mode & 07777);
+        if (to_fd == -1) {
+            break;
+        }
+        bool ok = detail::copy_contents(from_fd, to_fd, from_st.st_size, method);
+        int err = errno;
+        close(to_fd);
+        if (ok) {
+            used = method;
+            break;
+        }
+        unlink(tmp.c_str());
+        detail::copy_method_failed(from_st.st_dev, dir_st.st_dev, method, err);
+    }
+    close(from_fd);
+
+    if (!used) {
+        error("materialize(): Could not copy ", from, " to ", to, ": ", std::strerror(errno));
+        return std::nullopt;
+    }
+
+    if (rename(tmp.c_str(), to.c_str()) == -1) {
+        error("materialize(): Could not rename ", tmp, " to ", to, ": ", std::strerror(errno));
+        unlink(tmp.c_str());
+        return std::nullopt;
+    }
+    /* rename() does nothing when both names are links to the same file, so tmp may still be there */
+    unlink(tmp.c_str());
+
+    invalidate_stats(to);
+    info("Materialized ", to, " from ", from, " (", *used, ")");
+    return used;
+}
+
+namespace detail {
+
+bool copy_up_to_date(const fs::path& from, const fs::path& to, CopyCheck check)
+{
+    if (check == CopyCheck::None) {
+        return false;
+    }
+    FileStat from_st = stat_cached(from);
+    FileStat to_st = stat_cached(to);
+    if (!to_st.exists || to_st.is_dir || to_st.size != from_st.size) {
+        return false;
+    }
+    if (check == CopyCheck::SizeAndMtime) {
+        return to_st.mtime == from_st.mtime;
+    }
+    auto from_hash = sha256_file(from);
+    return from_hash && from_hash == sha256_file(to);
+}
+
+}
+
+bool copy(const fs::path& from, const fs::path& to, CopyCheck check)
+{
+    FileStat from_st = stat_cached(from);
+    if (!from_st.exists || from_st.is_dir) {
+        error("copy(): ", from, " is not a file");
+        return false;
+    }
+    if (detail::copy_up_to_date(from, to, check)) {
+        return true;
+    }
+    if (!materialize(from, to, false)) {
+        return false;
+    }
+
+    /* Same mtime as the source, so the next SizeAndMtime check can skip it */
+    struct timespec times[2];
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = from_st.mtime / 1000000000;
+    times[1].tv_nsec = from_st.mtime % 1000000000;
+    utimensat(AT_FDCWD, to.c_str(), times, 0);
+    invalidate_stats(to);
+    return true;
+}
+
+bool copy_tree(const fs::path& from, const fs::path& to, CopyCheck check, std::size_t jobs)
+{
+    auto files = walk(from);
+    std::vector<fs::path> targets;
+    std::vector<fs::path> dirs;
+    for (const auto& file : files) {
+        targets.push_back(to / file.lexically_relative(from));
+        if (dirs.empty() || dirs.back() != targets.back().parent_path()) {
+            dirs.push_back(targets.back().parent_path());
+        }
+    }
+
+    /* Create the directories once up front instead of racing on them per file */
+    std::sort(dirs.begin(), dirs.end());
+    dirs.erase(std::unique(dirs.begin(), dirs.end()), dirs.end());
+    for (const auto& dir : dirs) {
+        std::error_code ec;
+        fs::create_directories(dir, ec);
+        if (ec) {
+            error("copy_tree(): Could not create ", dir, ": ", ec.message());
+            return false;
+        }
+        invalidate_stats(dir);
+    }
+
+    std::vector<fs::path> all = files;
+    all.insert(all.end(), targets.begin(), targets.end());
+    prefetch_stats(all, jobs);
+
+    jobs = std::max<std::size_t>(std::min(jobs, files.size()), 1);
+    std::atomic<std::size_t> next { 0 };
+    std::atomic<bool> ok { true };
+    auto worker = [&]() {
+        for (std::size_t i; (i = next++) < files.size();) {
+            if (!copy(files[i], targets[i], check)) {
+                ok = false;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (std::size_t i = 1; i < jobs; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return ok;
+}
+
+namespace detail {
+
+/* RAII flock(), used to serialize nob processes sharing on-disk state */
+class FileLock {
+public:
+    FileLock(const fs::path& path, bool exclusive = true)
+    {
+        m_fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (m_fd == -1) {
+            throw std::runtime_error("FileLock(): Could not open " + path.string() + ": " + std::strerror(errno));
+        }
+        while (flock(m_fd, exclusive ? LOCK_EX : LOCK_SH) == -1) {
+            if (errno != EINTR) {
+                close(m_fd);
+                throw std::runtime_error("FileLock(): Could not lock " + path.string() + ": " + std::strerror(errno));
+            }
+        }
+    }
+
+    ~FileLock()
+    {
+        flock(m_fd, LOCK_UN);
+        close(m_fd);
+    }
+
+    FileLock(const FileLock&) = delete;
+    FileLock& operator=(const FileLock&) = delete;
+
+private:
+    int m_fd;
+};
+
+std::int64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+}
+
+Cache::Cache(fs::path dir, std::uintmax_t max_size)
+    : m_dir(std::move(dir)), m_max_size(max_size)
+{
+    fs::create_directories(m_dir / "objects");
+}
+
+std::optional<CopyMethod> Cache::get(const std::string& key, const fs::path& out, bool allow_hardlink)
+{
+    check_key(key);
+    detail::FileLock lock(m_dir / "lock");
+    auto index = read_index();
+    auto it = index.find(key);
+    /* Other processes change the cache, what this one knew about it is stale once we hold the lock */
+    invalidate_stats(object_path(key));
+    if (it == index.end() || !stat_cached(object_path(key)).exists) {
+        info("Cache miss: ", key);
+        Event("cache").field("cache", "local").field("key", key).field("hit", false).emit();
+        return std::nullopt;
+    }
+
+    auto method = materialize(object_path(key), out, allow_hardlink);
+    if (method) {
+        it->second.last_used = detail::now_ns();
+        write_index(index);
+        Event("cache").field("cache", "local").field("key", key).field("hit", true)
+            .field("method", *method).field("bytes", it->second.size).emit();
+    }
+    return method;
+}
+
+bool Cache::contains(const std::string& key)
+{
+    check_key(key);
+    detail::FileLock lock(m_dir / "lock");
+    auto index = read_index();
+    invalidate_stats(object_path(key));
+    return index.count(key) != 0 && stat_cached(object_path(key)).exists;
+}
+
+bool Cache::put(const std::string& key, const fs::path& file)
+{
+    check_key(key);
+    detail::FileLock lock(m_dir / "lock");
+
+    /* Never hardlink on the way in, the build may later rewrite `file` in place */
+    if (!materialize(file, object_path(key), false)) {
+        return false;
+    }
+
+    auto index = read_index();
+    index[key] = Entry { stat_cached(object_path(key)).size, detail::now_ns() };
+    evict_locked(index);
+    write_index(index);
+    return true;
+}
+
+void Cache::evict()
+{
+    detail::FileLock lock(m_dir / "lock");
+    auto index = read_index();
+    evict_locked(index);
+    write_index(index);
+}
+
+std::uintmax_t Cache::size()
+{
+    detail::FileLock lock(m_dir / "lock", false);
+    std::uintmax_t total = 0;
+    for (auto& [key, entry] : read_index()) {
+        total += entry.size;
+    }
+    return total;
+}
+
+void Cache::check_key(const std::string& key)
+{
+    if (key.empty() || key.find('/') != std::string::npos || key[0] == '.') {
+        throw std::runtime_error("Cache: Invalid key '" + key + "'");
+    }
+}
+
+fs::path Cache::object_path(const std::string& key) const
+{
+    return m_dir / "objects" / key;
+}
+
+std::map<std::string, Cache::Entry> Cache::read_index() const
+{
+    std::map<std::string, Entry> index;
+    std::ifstream in(m_dir / "index");
+    std::string key;
+    Entry entry;
+    while (in >> key >> entry.size >> entry.last_used) {
+        index[key] = entry;
+    }
+    return index;
+}
+
+void Cache::write_index(const std::map<std::string, Entry>& index) const
+{
+    std::string out;
+    for (auto& [key, entry] : index) {
+        out += key + ' ' + std::to_string(entry.size) + ' ' + std::to_string(entry.last_used) + '\n';
+    }
+    if (!detail::atomic_write(m_dir / "index", out)) {
+        throw std::runtime_error("Cache: Could not write " + (m_dir / "index").string());
+    }
+}
+
+void Cache::evict_locked(std::map<std::string, Entry>& index)
+{
+    /* Objects not in the index are leftovers of interrupted puts */
+    for (auto& entry : fs::directory_iterator(m_dir / "objects")) {
+        if (index.count(entry.path().filename().string()) == 0) {
+            fs::remove(entry.path());
+            invalidate_stats(entry.path());
+        }
+    }
+
+    std::uintmax_t total = 0;
+    std::vector<std::pair<std::int64_t, std::string>> lru;
+    for (auto& [key, entry] : index) {
+        total += entry.size;
+        lru.emplace_back(entry.last_used, key);
+    }
+    std::sort(lru.begin(), lru.end());
+
+    for (auto& [last_used, key] : lru) {
+        if (total <= m_max_size) {
+            break;
+        }
+        info("Cache: evicting ", key);
+        fs::remove(object_path(key));
+        invalidate_stats(object_path(key));
+        total -= index[key].size;
+        index.erase(key);
+    }
+}
+
+BuildOutputs::BuildOutputs(fs::path build_dir)
+    : m_dir(fs::absolute(std::move(build_dir)))
+{
+    fs::create_directories(m_dir);
+}
+
+void BuildOutputs::claim(const std::string& target, const std::vector<fs::path>& outputs)
+{
+    std::vector<fs::path> paths;
+    for (const auto& output : outputs) {
+        paths.push_back(fs::absolute(output).lexically_normal());
+    }
+
+    detail::FileLock lock(m_dir / ".nob_outputs.lock");
+    auto db = read_db();
+    remove_outputs(db, target, paths);
+    db[target] = paths;
+    write_db(db);
+    m_claimed.push_back(target);
+}
+
+void BuildOutputs::clean(const std::vector<std::string>& targets)
+{
+    detail::FileLock lock(m_dir / ".nob_outputs.lock");
+    auto db = read_db();
+    std::vector<std::string> names = targets;
+    if (names.empty()) {
+        for (const auto& [target, paths] : db) {
+            names.push_back(target);
+        }
+    }
+    for (const auto& target : names) {
+        if (db.count(target) == 0) {
+            warning("Nothing recorded for target ", target, ", not cleaning it");
+            continue;
+        }
+        remove_outputs(db, target);
+        db.erase(target);
+    }
+    write_db(db);
+}
+
+void BuildOutputs::gc()
+{
+    detail::FileLock lock(m_dir / ".nob_outputs.lock");
+    auto db = read_db();
+    for (auto it = db.begin(); it != db.end();) {
+        if (std::find(m_claimed.begin(), m_claimed.end(), it->first) != m_claimed.end()) {
+            ++it;
+            continue;
+        }
+        info("Removing outputs of unclaimed target ", it->first);
+        remove_outputs(db, it->first);
+        it = db.erase(it);
+    }
+    write_db(db);
+}
+
+std::vector<std::string> BuildOutputs::targets()
+{
+    detail::FileLock lock(m_dir / ".nob_outputs.lock", false);
+    std::vector<std::string> names;
+    for (const auto& [target, paths] : read_db()) {
+        names.push_back(target);
+    }
+    return names;
+}
+
+BuildOutputs::Db BuildOutputs::read_db() const
+{
+    Db db;
+    std::ifstream in(m_dir / ".nob_outputs");
+    std::string line;
+    while (std::getline(in, line)) {
+        auto tab = line.find('\t');
+        if (tab != std::string::npos) {
+            db[line.substr(0, tab)].push_back(line.substr(tab + 1));
+        }
+    }
+    return db;
+}
+
+void BuildOutputs::write_db(const Db& db) const
+{
+    std::string out;
+    for (const auto& [target, paths] : db) {
+        for (const auto& path : paths) {
+            out += target + '\t' + path.string() + '\n';
+        }
+    }
+    if (!detail::atomic_write(m_dir / ".nob_outputs", out)) {
+        throw std::runtime_error("BuildOutputs: Could not write " + (m_dir / ".nob_outputs").string());
+    }
+}
+
+void BuildOutputs::remove_outputs(Db& db, const std::string& target, const std::vector<fs::path>& keep)
+{
+    auto it = db.find(target);
+    if (it == db.end()) {
+        return;
+    }
+    for (const auto& path : it->second) {
+        if (std::find(keep.begin(), keep.end(), path) != keep.end()) {
+            continue;
+        }
+        bool shared = false;
+        for (const auto& [other, paths] : db) {
+            if (other != target && std::find(paths.begin(), paths.end(), path) != paths.end()) {
+                shared = true;
+                break;
+            }
+        }
+        if (!shared) {
+            remove_recursive(path);
+        }
+    }
+}
+
+namespace detail {
+
+class Sha256 {
+public:
+    Sha256()
+    {
+        static const std::uint32_t init[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+            0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+        };
+        std::memcpy(m_state, init, sizeof(m_state));
+    }
+
+    void update(const void* data, std::size_t size)
+    {
+        auto bytes = static_cast<const unsigned char*>(data);
+        m_length += size;
+        while (size > 0) {
+            std::size_t n = std::min(size, sizeof(m_block) - m_used);
+            std::memcpy(m_block + m_used, bytes, n);
+            m_used += n;
+            bytes += n;
+            size -= n;
+            if (m_used == sizeof(m_block)) {
+                compress();
+                m_used = 0;
+            }
+        }
+    }
+
+    std::string hex_digest()
+    {
+        std::uint64_t bits = m_length * 8;
+        unsigned char pad = 0x80;
+        update(&pad, 1);
+        pad = 0;
+        while (m_used != 56) {
+            update(&pad, 1);
+        }
+        unsigned char len[8];
+        for (int i = 0; i < 8; i++) {
+            len[i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+        }
+        update(len, 8);
+
+        static const char* hex = "0123456789abcdef";
+        std::string out;
+        for (std::uint32_t word : m_state) {
+            for (int shift = 28; shift >= 0; shift -= 4) {
+                out += hex[(word >> shift) & 0xf];
+            }
+        }
+        return out;
+    }
+
+private:
+    static std::uint32_t rotr(std::uint32_t x, int n)
+    {
+        return (x >> n) | (x << (32 - n));
+    }
+
+    void compress()
+    {
+        static const std::uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+        };
+
+        std::uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (std::uint32_t(m_block[4 * i]) << 24) | (std::uint32_t(m_block[4 * i + 1]) << 16)
+                 | (std::uint32_t(m_block[4 * i + 2]) << 8) | std::uint32_t(m_block[4 * i + 3]);
+        }
+        for (int i = 16; i < 64; i++) {
+            std::uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            std::uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        std::uint32_t a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+        std::uint32_t e = m_state[4], f = m_state[5], g = m_state[6], h = m_state[7];
+        for (int i = 0; i < 64; i++) {
+            std::uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+            std::uint32_t ch = (e & f) ^ (~e & g);
+            std::uint32_t t1 = h + s1 + ch + k[i] + w[i];
+            std::uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+            std::uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+            std::uint32_t t2 = s0 + maj;
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        m_state[0] += a; m_state[1] += b; m_state[2] += c; m_state[3] += d;
+        m_state[4] += e; m_state[5] += f; m_state[6] += g; m_state[7] += h;
+    }
+
+    std::uint32_t m_state[8];
+    unsigned char m_block[64];
+    std::size_t m_used = 0;
+    std::uint64_t m_length = 0;
+};
+
+}
+
+BuildLock::BuildLock(int fd, LockMode mode)
+    : m_fd(fd)
+    , m_mode(mode)
+{
+}
+
+BuildLock::~BuildLock()
+{
+    release();
+}
+
+BuildLock::BuildLock(BuildLock&& other) noexcept
+    : m_fd(std::exchange(other.m_fd, -1))
+    , m_mode(other.m_mode)
+{
+}
+
+BuildLock& BuildLock::operator=(BuildLock&& other) noexcept
+{
+    if (this != &other) {
+        release();
+        m_fd = std::exchange(other.m_fd, -1);
+        m_mode = other.m_mode;
+    }
+    return *this;
+}
+
+LockMode BuildLock::mode() const
+{
+    return m_mode;
+}
+
+void BuildLock::release()
+{
+    if (m_fd == -1) {
+        return;
+    }
+    if (m_mode == LockMode::Exclusive) {
+        /* Clears the holder's pid, shown to whoever waits next */
+        (void)ftruncate(m_fd, 0);
+    }
+    flock(m_fd, LOCK_UN);
+    close(m_fd);
+    m_fd = -1;
+}
+
+std::optional<BuildLock> BuildLock::acquire(const fs::path& build_dir, BuildLockOptions options)
+{
+    fs::path path = build_dir / ".nob_lock";
+    int op = options.mode == LockMode::Exclusive ? LOCK_EX : LOCK_SH;
+    auto start = std::chrono::steady_clock::now();
+    auto backoff = std::chrono::milliseconds(1);
+    bool announced = false;
+
+    for (;;) {
+        std::error_code ec;
+        fs::create_directories(build_dir, ec);
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            error("Could not open ", path, ": ", std::strerror(errno));
+            return std::nullopt;
+        }
+
+        while (flock(fd, op | LOCK_NB) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EWOULDBLOCK) {
+                error("Could not lock ", path, ": ", std::strerror(errno));
+                close(fd);
+                return std::nullopt;
+            }
+            if (!options.wait) {
+                error(path, " is held by another nob process");
+                close(fd);
+                return std::nullopt;
+            }
+            auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+            if (options.timeout && waited >= *options.timeout) {
+                error("Timed out after ", waited.count(), "ms waiting for ", path);
+                close(fd);
+                return std::nullopt;
+            }
+            if (!announced) {
+                char holder[32] = {};
+                ssize_t n = pread(fd, holder, sizeof(holder) - 1, 0);
+                std::string_view pid(holder, n > 0 ? static_cast<std::size_t>(n) : 0);
+                while (!pid.empty() && pid.back() == '\n') {
+                    pid.remove_suffix(1);
+                }
+                if (pid.empty()) {
+                    info("Waiting for ", path);
+                } else {
+                    info("Waiting for ", path, ", held by pid ", pid);
+                }
+                announced = true;
+            }
+            if (!options.timeout) {
+                while (flock(fd, op) == -1 && errno == EINTR) {
+                }
+                continue;
+            }
+            std::this_thread::sleep_for(std::min(backoff, *options.timeout - waited));
+            backoff = std::min(backoff * 2, std::chrono::milliseconds(100));
+        }
+
+        /*
+         * A distclean may have removed the file while we waited on it, a lock
+         * on an unlinked inode excludes no one, so start over on the new one.
+         */
+        struct stat held, current;
+        if (fstat(fd, &held) == 0 && ::stat(path.c_str(), &current) == 0
+            && held.st_dev == current.st_dev && held.st_ino == current.st_ino) {
+            if (options.mode == LockMode::Exclusive) {
+                std::string pid = std::to_string(getpid()) + "\n";
+                if (ftruncate(fd, 0) == 0) {
+                    (void)pwrite(fd, pid.data(), pid.size(), 0);
+                }
+            }
+            if (event_log_enabled()) {
+                Event("lock").field("path", path)
+                    .field("mode", options.mode == LockMode::Exclusive ? "exclusive" : "shared")
+                    .field("waited_ms", std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count())
+                    .emit();
+            }
+            return BuildLock(fd, options.mode);
+        }
+        flock(fd, LOCK_UN);
+        close(fd);
+    }
+}
+
+std::string sha256(const std::string& data)
+{
+    detail::Sha256 h;
+    h.update(data.data(), data.size());
+    return h.hex_digest();
+}
+
+std::optional<std::string> sha256_file(const fs::path& path)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        return std::nullopt;
+    }
+    detail::Sha256 h;
+    char buffer[1 << 16];
+    while (in) {
+        in.read(buffer, sizeof(buffer));
+        h.update(buffer, in.gcount());
+    }
+    return h.hex_digest();
+}
+
+std::optional<std::string> read_file(const fs::path& path)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        return std::nullopt;
+    }
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+namespace detail {
+
+/* Whether the file open as `fd` holds exactly `data`, compared in place through mmap() */
+bool same_contents(int fd, std::string_view data)
+{
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || static_cast<std::size_t>(st.st_size) != data.size()) {
+        return false;
+    }
+    if (data.empty()) {
+        return true;
+    }
+    void* mapped = mmap(nullptr, data.size(), PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+    bool same = std::memcmp(mapped, data.data(), data.size()) == 0;
+    munmap(mapped, data.size());
+    return same;
+}
+
+}
+
+std::optional<bool> write_file_if_changed(const fs::path& path, std::string_view data)
+{
+    mode_t mode = 0644;
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        bool same = detail::same_contents(fd, data);
+        struct stat st;
+        if (!same && fstat(fd, &st) == 0) {
+            mode = st.st_mode & 07777;
+        }
+        close(fd);
+        if (same) {
+            return false;
+        }
+    }
+
+    if (!detail::atomic_write(path, data, mode)) {
+        return std::nullopt;
+    }
+    return true;
+}
+
+HttpClient::HttpClient(std::string host, std::string port, std::size_t max_connections)
+    : m_host(std::move(host)), m_port(std::move(port)), m_max_connections(std::max<std::size_t>(max_connections, 1))
+{
+}
+
+HttpClient::~HttpClient()
+{
+    for (int fd : m_idle) {
+        close(fd);
+    }
+}
+
+std::optional<HttpClient::Response> HttpClient::request(const std::string& method, const std::string& path, const std::string& body)
+{
+    std::string req = method + " " + path + " HTTP/1.1\r\n"
+                    + "Host: " + m_host + ":" + m_port + "\r\n"
+                    + "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                    + "\r\n";
+    req += body;
+
+    /* A pooled connection may have been closed by the server, retry once on a fresh one */
+    for (int attempt = 0; attempt < 2; attempt++) {
+        bool reused = false;
+        int fd = acquire(reused);
+        if (fd == -1) {
+            return std::nullopt;
+        }
+        Response response;
+        bool keep_alive = false;
+        if (send_all(fd, req) && read_response(fd, method == "HEAD", response, keep_alive)) {
+            release(fd, keep_alive);
+            return response;
+        }
+        release(fd, false);
+        if (!reused) {
+            break;
+        }
+    }
+    return std::nullopt;
+}
+
+int HttpClient::acquire(bool& reused)
+{
+    std::unique_lock<std::mutex> lock(m_mtx);
+    m_cv.wait(lock, [this] { return !m_idle.empty() || m_open < m_max_connections; });
+    if (!m_idle.empty()) {
+        int fd = m_idle.back();
+        m_idle.pop_back();
+        reused = true;
+        return fd;
+    }
+    m_open++;
+    lock.unlock();
+
+    int fd = connect_to();
+    if (fd == -1) {
+        lock.lock();
+        m_open--;
+        m_cv.notify_one();
+    }
+    return fd;
+}
+
+void HttpClient::release(int fd, bool reusable)
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    if (reusable) {
+        m_idle.push_back(fd);
+    } else {
+        close(fd);
+        m_open--;
+    }
+    m_cv.notify_one();
+}
+
+int HttpClient::connect_to()
+{
+    addrinfo hints {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* res = nullptr;
+    if (getaddrinfo(m_host.c_str(), m_port.c_str(), &hints, &res) != 0) {
+        error("HttpClient: Could not resolve ", m_host);
+        return -1;
+    }
+
+    int fd = -1;
+    for (addrinfo* ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+        if (::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd == -1) {
+        error("HttpClient: Could not connect to ", m_host, ":", m_port, ": ", std::strerror(errno));
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    timeval timeout { 60, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+bool HttpClient::send_all(int fd, const std::string& data)
+{
+    std::size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+bool HttpClient::fill(int fd, std::string& buf)
+{
+    char chunk[1 << 16];
+    for (;;) {
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        buf.append(chunk, n);
+        return true;
+    }
+}
+
+bool HttpClient::read_line(int fd, std::string& buf, std::size_t& pos, std::string& line)
+{
+    std::size_t end;
+    while ((end = buf.find("\r\n", pos)) == std::string::npos) {
+        if (!fill(fd, buf)) {
+            return false;
+        }
+    }
+    line = buf.substr(pos, end - pos);
+    pos = end + 2;
+    return true;
+}
+
+bool HttpClient::read_exact(int fd, std::string& buf, std::size_t& pos, std::size_t size, std::string& out)
+{
+    while (buf.size() - pos < size) {
+        if (!fill(fd, buf)) {
+            return false;
+        }
+    }
+    out.append(buf, pos, size);
+    pos += size;
+    return true;
+}
+
+/* A malformed response is a failed request and its connection isn't reused */
+bool HttpClient::read_response(int fd, bool head, Response& response, bool& keep_alive)
+{
+    std::string buf;
+    std::size_t pos = 0;
+    std::string line;
+
+    if (!read_line(fd, buf, pos, line) || line.compare(0, 5, "HTTP/") != 0 || line.size() < 12) {
+        return false;
+    }
+    response.status = std::atoi(line.c_str() + 9);
+    keep_alive = line.compare(0, 8, "HTTP/1.0") != 0;
+
+    std::optional<std::size_t> content_length;
+    bool chunked = false;
+    while (read_line(fd, buf, pos, line) && !line.empty()) {
+        auto colon = line.find(':');
+        if (colon == std::string::npos) {
+            continue;
+        }
+        std::string name = line.substr(0, colon);
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        std::string_view value = detail::trim(std::string_view(line).substr(colon + 1));
+        std::string lower(value);
+        std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+        if (name == "content-length") {
+            content_length = detail::parse_int(value);
+            if (!content_length) {
+                return false;
+            }
+        } else if (name == "transfer-encoding") {
+            chunked = lower.find("chunked") != std::string::npos;
+        } else if (name == "connection") {
+            keep_alive = lower.find("close") == std::string::npos;
+        }
+    }
+    if (!line.empty()) {
+        return false;
+    }
+
+    if (head || response.status == 204 || response.status == 304 || response.status / 100 == 1) {
+        return true;
+    }
+
+    if (chunked) {
+        for (;;) {
+            if (!read_line(fd, buf, pos, line)) {
+                return false;
+            }
+            /* Chunk extensions after ';' carry nothing we need */
+            auto size = detail::parse_int(std::string_view(line).substr(0, line.find(';')), 16);
+            if (!size) {
+                return false;
+            }
+            if (*size == 0) {
+                while (read_line(fd, buf, pos, line) && !line.empty()) {}
+                return line.empty();
+            }
+            if (!read_exact(fd, buf, pos, *size, response.body) || !read_line(fd, buf, pos, line) || !line.empty()) {
+                return false;
+            }
+        }
+    }
+
+    if (content_length) {
+        return read_exact(fd, buf, pos, *content_length, response.body);
+    }
+
+    /* No length, the body runs until the server closes the connection */
+    keep_alive = false;
+    response.body.append(buf, pos, std::string::npos);
+    while (fill(fd, response.body)) {}
+    return true;
+}
+
+RemoteCache::RemoteCache(const std::string& url, std::size_t max_connections)
+    : m_url(parse_url(url)),
+      m_max_connections(std::max<std::size_t>(max_connections, 1)),
+      m_http(m_url.host, m_url.port, m_max_connections)
+{
+}
+
+std::optional<std::string> RemoteCache::get(Store store, const std::string& hash)
+{
+    auto response = m_http.request("GET", path(store, hash));
+    if (!response || response->status != 200) {
+        return std::nullopt;
+    }
+    return std::move(response->body);
+}
+
+bool RemoteCache::put(Store store, const std::string& hash, const std::string& data)
+{
+    auto response = m_http.request("PUT", path(store, hash), data);
+    if (!response || response->status / 100 != 2) {
+        error("RemoteCache: PUT ", path(store, hash), " failed");
+        return false;
+    }
+    return true;
+}
+
+bool RemoteCache::fetch_output(const std::string& action_key, const fs::path& out)
+{
+    auto result = get(Store::ActionCache, action_key);
+    if (!result) {
+        info("Remote cache miss: ", action_key);
+        Event("cache").field("cache", "remote").field("key", action_key).field("hit", false).emit();
+        return false;
+    }
+
+    std::string hash = result->substr(0, result->find(' '));
+    auto blob = get(Store::Cas, hash);
+    if (!blob || sha256(*blob) != hash) {
+        warning("Remote cache: blob ", hash, " for ", action_key, " is missing or corrupt");
+        return false;
+    }
+
+    if (!detail::atomic_write(out, *blob)) {
+        return false;
+    }
+    info("Remote cache hit: ", action_key, " -> ", out);
+    Event("cache").field("cache", "remote").field("key", action_key).field("hit", true)
+        .field("bytes", blob->size()).emit();
+    return true;
+}
+
+bool RemoteCache::store_output(const std::string& action_key, const fs::path& file)
+{
+    auto data = read_file(file);
+    if (!data) {
+        error("RemoteCache: Could not read ", file);
+        return false;
+    }
+    std::string hash = sha256(*data);
+    return put(Store::Cas, hash, *data)
+        && put(Store::ActionCache, action_key, hash + " " + std::to_string(data->size()));
+}
+
+std::vector<bool> RemoteCache::fetch_outputs(const std::vector<std::pair<std::string, fs::path>>& outputs)
+{
+    std::vector<bool> results(outputs.size());
+    std::atomic<std::size_t> next { 0 };
+    std::vector<std::thread> threads;
+    std::mutex results_mtx;
+    for (std::size_t i = 0; i < std::min(m_max_connections, outputs.size()); i++) {
+        threads.emplace_back([&] {
+            for (std::size_t j; (j = next++) < outputs.size();) {
+                bool ok = fetch_output(outputs[j].first, outputs[j].second);
+                std::lock_guard<std::mutex> lock(results_mtx);
+                results[j] = ok;
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    return results;
+}
+
+RemoteCache::Url RemoteCache::parse_url(const std::string& url)
+{
+    std::string rest = url;
+    if (rest.compare(0, 7, "http://") == 0) {
+        rest = rest.substr(7);
+    } else if (rest.find("://") != std::string::npos) {
+        throw std::runtime_error("RemoteCache: Only http:// urls are supported: " + url);
+    }
+
+    Url result;
+    auto slash = rest.find('/');
+    std::string authority = rest.substr(0, slash);
+    result.prefix = slash == std::string::npos ? "" : rest.substr(slash);
+    while (!result.prefix.empty() && result.prefix.back() == '/') {
+        result.prefix.pop_back();
+    }
+
+    auto colon = authority.rfind(':');
+    result.host = authority.substr(0, colon);
+    result.port = colon == std::string::npos ? "80" : authority.substr(colon + 1);
+    return result;
+}
+
+std::string RemoteCache::path(Store store, const std::string& hash) const
+{
+    return m_url.prefix + (store == Store::ActionCache ? "/ac/" : "/cas/") + hash;
+}
+
+fs::path get_project_root()
+{
+    return fs::path(get_executable_path()).remove_filename();
+}
+
+Dir::Dir(const fs::path& path)
+    : m_path(fs::absolute(path).lexically_normal())
+{
+    m_fd = ::open(m_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (m_fd == -1) {
+        throw std::runtime_error("Dir(): Could not open " + m_path.string() + ": " + std::strerror(errno));
+    }
+}
+
+Dir::~Dir()
+{
+    if (m_fd != -1) {
+        close(m_fd);
+    }
+}
+
+Dir::Dir(Dir&& other) noexcept
+    : m_fd(std::exchange(other.m_fd, -1))
+    , m_path(std::move(other.m_path))
+{
+}
+
+Dir& Dir::operator=(Dir&& other) noexcept
+{
+    if (this != &other) {
+        if (m_fd != -1) {
+            close(m_fd);
+        }
+        m_fd = std::exchange(other.m_fd, -1);
+        m_path = std::move(other.m_path);
+    }
+    return *this;
+}
+
+int Dir::fd() const
+{
+    return m_fd;
+}
+
+const fs::path& Dir::path() const
+{
+    return m_path;
+}
+
+fs::path Dir::operator/(const fs::path& relative) const
+{
+    return (m_path / relative).lexically_normal();
+}
+
+Dir Dir::open(const fs::path& relative) const
+{
+    mkdir(relative);
+    return Dir(*this / relative);
+}
+
+bool Dir::exists(const fs::path& relative) const
+{
+    return stat_cached(*this / relative).exists;
+}
+
+bool Dir::mkdir(const fs::path& relative) const
+{
+    /* mkdirat() one component at a time, all relative to our fd */
+    fs::path partial;
+    for (const auto& part : relative.lexically_normal()) {
+        if (part.empty()) {
+            continue;
+        }
+        partial /= part;
+        if (mkdirat(m_fd, partial.c_str(), 0755) == -1 && errno != EEXIST) {
+            error("Could not create ", *this / partial, ": ", std::strerror(errno));
+            return false;
+        }
+    }
+    struct stat st;
+    if (fstatat(m_fd, relative.c_str(), &st, 0) == -1 || !S_ISDIR(st.st_mode)) {
+        error(*this / relative, " already exists and is not a directory");
+        return false;
+    }
+    invalidate_stats(*this / relative);
+    return true;
+}
+
+void Dir::remove(const fs::path& relative) const
+{
+    warning("Removing ", *this / relative);
+    if (unlinkat(m_fd, relative.c_str(), 0) == -1 && errno == EISDIR) {
+        unlinkat(m_fd, relative.c_str(), AT_REMOVEDIR);
+    }
+    invalidate_stats(*this / relative);
+}
+
+std::optional<std::string> Dir::read_file(const fs::path& relative) const
+{
+    int fd = openat(m_fd, relative.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return std::nullopt;
+    }
+    std::string data;
+    char buffer[64 * 1024];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) != 0) {
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            return std::nullopt;
+        }
+        data.append(buffer, n);
+    }
+    close(fd);
+    return data;
+}
+
+std::optional<bool> Dir::write_file_if_changed(const fs::path& relative, std::string_view data) const
+{
+    return nob::write_file_if_changed(*this / relative, data);
+}
+
+bool cd(const fs::path& path)
+{
+    info("Changing working dir to ", path);
+    fs::current_path(path);
+    /* Cached entries are keyed by absolute path, but the cwd used to make them is stale now */
+    invalidate_stats();
+    return true; /* TODO: Check fail */
+}
+
+void Cmd::set_wd(const fs::path& path)
+{
+    m_working_dir = path;
+}
+
+void Cmd::set_wd(const Dir& dir)
+{
+    m_working_dir = dir.path();
+}
+
+int Cmd::run_sync()
+{
+    if (!detail::status_line().quiet_cmds.load(std::memory_order_relaxed)) {
+        info("Running sync: ", *this);
+    }
+    auto start = std::chrono::steady_clock::now();
+    std::vector<char*> argv;
+    for (auto& s : m_command) {
+        argv.push_back(s.data());
+    }
+    argv.push_back(nullptr);
+
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        throw std::runtime_error("run_sync(): fork() failed: " + std::string(std::strerror(errno)));
+    } else if (pid == 0) {
+        /* Only async-signal-safe calls between fork() and exec(), other threads may hold locks */
+        if (m_working_dir != "." && chdir(m_working_dir.c_str()) == -1) {
+            perror("run_sync(): chdir failed");
+            _exit(1);
+        }
+        execvp(argv[0], argv.data());
+        perror("run_sync(): execvp failed");
+        _exit(1);
+    } else {
+        detail::cmd_start_event(pid, *this);
+        int status = detail::wait_cmd(pid, *this, start);
+        invalidate_stats();
+        if (WIFEXITED(status)) {
+            return WEXITSTATUS(status);
+        } else {
+            return 1;
+        }
+    }
+}
+
+int Cmd::run_sync_capture(std::ostream& out, bool merge_stderr)
+{
+    if (!detail::status_line().quiet_cmds.load(std::memory_order_relaxed)) {
+        info("Running sync capture: ", *this);
+    }
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<char*> argv;
+    for (auto& s : m_command) {
+        argv.push_back(s.data());
+    }
+    argv.push_back(nullptr);
+
+    int pipefd[2];
+    if (pipe(pipefd) == -1) {
+        throw std::runtime_error("run_sync_capture(): pipe failed");
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        throw std::runtime_error("run_sync_capture(): fork() failed: " + std::string(std::strerror(errno)));
+    } else if (pid == 0) {
+        close(pipefd[0]);
+        dup2(pipefd[1], STDOUT_FILENO);
+        if (merge_stderr) {
+            dup2(pipefd[1], STDERR_FILENO);
+        }
+        close(pipefd[1]);
+        if (m_working_dir != "." && chdir(m_working_dir.c_str()) == -1) {
+            perror("run_sync_capture(): chdir failed");
+            _exit(1);
+        }
+        execvp(argv[0], argv.data());
+        perror("run_sync_capture(): execvp failed");
+        _exit(1);
+    } else {
+        close(pipefd[1]);
+        detail::cmd_start_event(pid, *this);
+        char buffer[4096];
+        ssize_t bytes_read;
+        while ((bytes_read = read(pipefd[0], buffer, sizeof(buffer))) != 0) {
+            if (bytes_read == -1) {
+                if (errno == EINTR) {
+                    continue;
+                } else {
+                    close(pipefd[0]);
+                    throw std::runtime_error("run_sync_capture(): Error reading from pipe");
+                }
+            }
+            out.write(buffer, bytes_read);
+        }
+
+        int status = detail::wait_cmd(pid, *this, start);
+        invalidate_stats();
+        close(pipefd[0]);
+        out.flush();
+        if (WIFEXITED(status)) {
+            return WEXITSTATUS(status);
+        } else {
+            return 1;
+        }
+    }
+}
+
+int Cmd::run_sync_capture(std::string& out, std::string& err)
+{
+    auto start = std::chrono::steady_clock::now();
+    std::vector<char*> argv;
+    for (auto& s : m_command) {
+        argv.push_back(s.data());
+    }
+    argv.push_back(nullptr);
+
+    int out_pipe[2];
+    int err_pipe[2];
+    if (pipe2(out_pipe, O_CLOEXEC) == -1) {
+        throw std::runtime_error("run_sync_capture(): pipe failed");
+    }
+    if (pipe2(err_pipe, O_CLOEXEC) == -1) {
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        throw std::runtime_error("run_sync_capture(): pipe failed");
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        throw std::runtime_error("run_sync_capture(): fork() failed: " + std::string(std::strerror(errno)));
+    } else if (pid == 0) {
+        dup2(out_pipe[1], STDOUT_FILENO);
+        dup2(err_pipe[1], STDERR_FILENO);
+        if (m_working_dir != "." && chdir(m_working_dir.c_str()) == -1) {
+            perror("run_sync_capture(): chdir failed");
+            _exit(1);
+        }
+        execvp(argv[0], argv.data());
+        perror("run_sync_capture(): execvp failed");
+        _exit(1);
+    }
+
+    close(out_pipe[1]);
+    close(err_pipe[1]);
+    detail::cmd_start_event(pid, *this);
+
+    /* Drain both pipes, a child blocked on a full stderr pipe would never exit */
+    struct pollfd fds[2] = { { out_pipe[0], POLLIN, 0 }, { err_pipe[0], POLLIN, 0 } };
+    std::string* sinks[2] = { &out, &err };
+    int open_fds = 2;
+    char buffer[4096];
+    while (open_fds > 0) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (int i = 0; i < 2; i++) {
+            if (fds[i].fd == -1 || fds[i].revents == 0) {
+                continue;
+            }
+            ssize_t n = read(fds[i].fd, buffer, sizeof(buffer));
+            if (n > 0) {
+                sinks[i]->append(buffer, n);
+            } else if (n == 0 || errno != EINTR) {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                open_fds--;
+            }
+        }
+    }
+    for (auto& fd : fds) {
+        if (fd.fd != -1) {
+            close(fd.fd);
+        }
+    }
+
+    int status = detail::wait_cmd(pid, *this, start);
+    invalidate_stats();
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    } else {
+        return 1;
+    }
+}
+
+void Cmd::reset()
+{
+    m_working_dir = ".";
+    m_command.clear();
+}
+
+const std::vector<std::string>& Cmd::args() const
+{
+    return m_command;
+}
+
+const fs::path& Cmd::wd() const
+{
+    return m_working_dir;
+}
+
+void format_to(std::string& out, const Cmd& cmd)
+{
+    out.append("Cmd working dir: ");
+    detail::format_quoted(out, cmd.wd().native());
+    out.append(";");
+    for (const auto& arg : cmd.args()) {
+        out.push_back(' ');
+        format_shell_arg(out, arg);
+    }
+}
+
+void format_shell_arg(std::string& out, std::string_view arg)
+{
+    auto plain = [](char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+            || (c != '\0' && std::strchr("@%_-+=:,./", c) != nullptr);
+    };
+    if (!arg.empty() && std::all_of(arg.begin(), arg.end(), plain)) {
+        out.append(arg);
+        return;
+    }
+
+    out.push_back('\'');
+    for (char c : arg) {
+        if (c == '\'') {
+            out.append("'\\''");
+        } else {
+            out.push_back(c);
+        }
+    }
+    out.push_back('\'');
+}
+
+bool run_parallel(const std::vector<Cmd>& cmds, std::size_t jobs, OutputPolicy policy)
+{
+    std::vector<std::string> names;
+    for (const auto& cmd : cmds) {
+        std::string name;
+        for (const auto& arg : cmd.args()) {
+            if (!name.empty()) {
+                name.push_back(' ');
+            }
+            format_shell_arg(name, arg);
+        }
+        names.push_back(std::move(name));
+    }
+
+    jobs = std::max<std::size_t>(std::min(jobs, cmds.size()), 1);
+    Progress progress(names, jobs);
+    std::atomic<std::size_t> next { 0 };
+    std::atomic<bool> failed { false };
+    std::mutex print_mtx;
+
+    auto worker = [&]() {
+        std::size_t i;
+        while (!failed.load() && (i = next++) < cmds.size()) {
+            Cmd cmd = cmds[i];
+            progress.start(names[i], names[i]);
+
+            int code;
+            std::string out;
+            std::string err;
+            if (policy == OutputPolicy::Stream) {
+                code = cmd.run_sync();
+            } else {
+                code = cmd.run_sync_capture(out, err);
+            }
+            if (code != 0) {
+                failed = true;
+            }
+
+            bool show = policy == OutputPolicy::Buffered && !(out.empty() && err.empty());
+            if (code != 0 || (policy == OutputPolicy::QuietSuccess && !err.empty())) {
+                show = true;
+            }
+            if (show) {
+                /* One job's report at a time, never split by another job's */
+                std::lock_guard<std::mutex> lock(print_mtx);
+                if (code != 0) {
+                    error("Failed with exit code ", code, ": ", cmd);
+                }
+                if (!detail::write_above_status(out + err)) {
+                    /* Two writes, so keep Progress's [n/N] lines from landing in between */
+                    std::cout.flush();
+                    std::lock_guard<std::mutex> status_lock(detail::status_line().mtx);
+                    detail::write_all(STDOUT_FILENO, out.data(), out.size());
+                    detail::write_all(STDERR_FILENO, err.data(), err.size());
+                }
+            }
+            progress.finish(names[i]);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (std::size_t j = 1; j < jobs; j++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return !failed.load();
+}
+
+namespace detail {
+
+/* Length-prefixed frames: u32 little-endian size followed by the payload */
+bool read_all(int fd, char* data, std::size_t size)
+{
+    while (size > 0) {
+        ssize_t n = read(fd, data, size);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+/*
+ * Blocks SIGPIPE for the calling thread only, so writing to a peer that went
+ * away fails with EPIPE instead of killing the process, without changing the
+ * disposition behind the back of the rest of the program.
+ */
+class SigpipeBlock {
+public:
+    SigpipeBlock()
+    {
+        sigemptyset(&m_set);
+        sigaddset(&m_set, SIGPIPE);
+        sigset_t pending;
+        m_was_pending = sigpending(&pending) == 0 && sigismember(&pending, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &m_set, &m_old);
+    }
+
+    ~SigpipeBlock()
+    {
+        /* Consumes the SIGPIPE a failed write raised while blocked, before unblocking */
+        int saved = errno;
+        if (!m_was_pending) {
+            timespec zero {};
+            while (sigtimedwait(&m_set, nullptr, &zero) == -1 && errno == EINTR) {
+            }
+        }
+        pthread_sigmask(SIG_SETMASK, &m_old, nullptr);
+        errno = saved;
+    }
+
+    SigpipeBlock(const SigpipeBlock&) = delete;
+    SigpipeBlock& operator=(const SigpipeBlock&) = delete;
+
+private:
+    sigset_t m_set;
+    sigset_t m_old;
+    bool m_was_pending;
+};
+
+/* The peer of a frame may have died: that's a failed write, not a SIGPIPE */
+bool write_frame(int fd, const std::string& payload)
+{
+    SigpipeBlock block;
+    unsigned char header[4];
+    for (int i = 0; i < 4; i++) {
+        header[i] = static_cast<unsigned char>(payload.size() >> (8 * i));
+    }
+    return write_all(fd, reinterpret_cast<const char*>(header), 4)
+        && write_all(fd, payload.data(), payload.size());
+}
+
+bool read_frame(int fd, std::string& payload)
+{
+    unsigned char header[4];
+    if (!read_all(fd, reinterpret_cast<char*>(header), 4)) {
+        return false;
+    }
+    std::uint32_t size = header[0] | (header[1] << 8) | (header[2] << 16) | (std::uint32_t(header[3]) << 24);
+    payload.resize(size);
+    return read_all(fd, payload.data(), size);
+}
+
+class Encoder {
+public:
+    void u32(std::uint32_t v)
+    {
+        for (int i = 0; i < 4; i++) {
+            m_out += static_cast<char>(v >> (8 * i));
+        }
+    }
+
+    void str(const std::string& s)
+    {
+        u32(s.size());
+        m_out += s;
+    }
+
+    const std::string& data() const
+    {
+        return m_out;
+    }
+
+private:
+    std::string m_out;
+};
+
+class Decoder {
+public:
+    Decoder(const std::string& in) : m_in(in) {}
+
+    std::uint32_t u32()
+    {
+        if (m_in.size() - m_pos < 4) {
+            throw std::runtime_error("Decoder: Truncated message");
+        }
+        std::uint32_t v = 0;
+        for (int i = 0; i < 4; i++) {
+            v |= std::uint32_t(static_cast<unsigned char>(m_in[m_pos++])) << (8 * i);
+        }
+        return v;
+    }
+
+    std::string str()
+    {
+        std::uint32_t size = u32();
+        if (m_in.size() - m_pos < size) {
+            throw std::runtime_error("Decoder: Truncated message");
+        }
+        std::string s = m_in.substr(m_pos, size);
+        m_pos += size;
+        return s;
+    }
+
+private:
+    const std::string& m_in;
+    std::size_t m_pos = 0;
+};
+
+}
+
+std::string WorkRequest::encode() const
+{
+    detail::Encoder e;
+    e.u32(argv.size());
+    for (auto& a : argv) {
+        e.str(a);
+    }
+    e.str(wd);
+    e.u32(inputs.size());
+    for (auto& [path, digest] : inputs) {
+        e.str(path);
+        e.str(digest);
+    }
+    e.u32(outputs.size());
+    for (auto& path : outputs) {
+        e.str(path);
+    }
+    return e.data();
+}
+
+WorkRequest WorkRequest::decode(const std::string& data)
+{
+    detail::Decoder d(data);
+    WorkRequest r;
+    for (std::uint32_t n = d.u32(); n > 0; n--) {
+        r.argv.push_back(d.str());
+    }
+    r.wd = d.str();
+    for (std::uint32_t n = d.u32(); n > 0; n--) {
+        std::string path = d.str();
+        r.inputs.emplace_back(path, d.str());
+    }
+    for (std::uint32_t n = d.u32(); n > 0; n--) {
+        r.outputs.push_back(d.str());
+    }
+    return r;
+}
+
+std::string WorkResponse::encode() const
+{
+    detail::Encoder e;
+    e.u32(static_cast<std::uint32_t>(exit_code));
+    e.str(output);
+    e.u32(files.size());
+    for (auto& [path, contents] : files) {
+        e.str(path);
+        e.str(contents);
+    }
+    return e.data();
+}
+
+WorkResponse WorkResponse::decode(const std::string& data)
+{
+    detail::Decoder d(data);
+    WorkResponse r;
+    r.exit_code = static_cast<int>(d.u32());
+    r.output = d.str();
+    for (std::uint32_t n = d.u32(); n > 0; n--) {
+        std::string path = d.str();
+        r.files.emplace_back(path, d.str());
+    }
+    return r;
+}
+
+namespace detail {
+
+sockaddr_un unix_address(const fs::path& path)
+{
+    sockaddr_un addr {};
+    addr.sun_family = AF_UNIX;
+    if (path.native().size() >= sizeof(addr.sun_path)) {
+        throw std::runtime_error("Socket path too long: " + path.string());
+    }
+    std::strcpy(addr.sun_path, path.c_str());
+    return addr;
+}
+
+}
+
+WorkResponse execute_work(const WorkRequest& request)
+{
+    WorkResponse response;
+    fs::path wd = request.wd.empty() ? fs::path(".") : fs::path(request.wd);
+
+    for (auto& [path, digest] : request.inputs) {
+        auto actual = sha256_file(wd / path);
+        if (!actual || *actual != digest) {
+            response.output = "worker: input " + path + " is missing or does not match its digest\n";
+            return response;
+        }
+    }
+
+    Cmd cmd;
+    for (auto& a : request.argv) {
+        cmd.add(a);
+    }
+    cmd.set_wd(wd);
+
+    std::ostringstream out;
+    response.exit_code = cmd.run_sync_capture(out, true);
+    response.output = out.str();
+
+    for (auto& path : request.outputs) {
+        auto contents = read_file(wd / path);
+        if (!contents) {
+            response.output += "worker: output " + path + " was not produced\n";
+            if (response.exit_code == 0) {
+                response.exit_code = 1;
+            }
+            continue;
+        }
+        response.files.emplace_back(path, std::move(*contents));
+    }
+    return response;
+}
+
+WorkerServer::WorkerServer(fs::path socket_path)
+    : m_socket_path(std::move(socket_path))
+{
+    sockaddr_un addr = detail::unix_address(m_socket_path);
+    m_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (m_listen_fd == -1) {
+        throw std::runtime_error("WorkerServer(): socket() failed: " + std::string(std::strerror(errno)));
+    }
+    unlink(m_socket_path.c_str());
+    if (bind(m_listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1
+        || listen(m_listen_fd, SOMAXCONN) == -1) {
+        close(m_listen_fd);
+        throw std::runtime_error("WorkerServer(): Could not listen on " + m_socket_path.string() + ": " + std::strerror(errno));
+    }
+}
+
+WorkerServer::~WorkerServer()
+{
+    stop();
+    std::vector<std::thread> finished;
+    {
+        std::unique_lock<std::mutex> lock(m_mtx);
+        m_cv.wait(lock, [this] { return m_connections.empty(); });
+        finished.swap(m_finished);
+    }
+    for (auto& t : finished) {
+        t.join();
+    }
+    close(m_listen_fd);
+    unlink(m_socket_path.c_str());
+}
+
+void WorkerServer::serve()
+{
+    info("Worker listening on ", m_socket_path);
+    while (!m_stopped) {
+        int fd = accept4(m_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+
+        std::vector<std::thread> finished;
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            if (m_stopped) {
+                close(fd);
+                break;
+            }
+            /* Inserted under the lock, which connection() takes before moving itself out */
+            m_connections.emplace(fd, std::thread([this, fd] { connection(fd); }));
+            finished.swap(m_finished);
+        }
+        for (auto& t : finished) {
+            t.join();
+        }
+    }
+}
+
+void WorkerServer::connection(int fd)
+{
+    std::string frame;
+    while (detail::read_frame(fd, frame)) {
+        WorkResponse response;
+        try {
+            response = execute_work(WorkRequest::decode(frame));
+        } catch (const std::exception& e) {
+            response.output = std::string("worker: ") + e.what() + "\n";
+        }
+        if (!detail::write_frame(fd, response.encode())) {
+            if (!m_stopped) {
+                warning("Worker: Could not send a response: ", std::strerror(errno));
+            }
+            break;
+        }
+    }
+
+    /* Closed under the lock, so stop() never shuts down a reused fd */
+    std::lock_guard<std::mutex> lock(m_mtx);
+    auto it = m_connections.find(fd);
+    m_finished.push_back(std::move(it->second));
+    m_connections.erase(it);
+    close(fd);
+    m_cv.notify_all();
+}
+
+void WorkerServer::stop()
+{
+    m_stopped = true;
+    shutdown(m_listen_fd, SHUT_RDWR);
+    std::lock_guard<std::mutex> lock(m_mtx);
+    for (auto& [fd, thread] : m_connections) {
+        shutdown(fd, SHUT_RDWR);
+    }
+}
+
+RemoteWorker::RemoteWorker(const fs::path& socket_path)
+{
+    sockaddr_un addr = detail::unix_address(socket_path);
+    m_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (m_fd == -1 || ::connect(m_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1) {
+        int err = errno;
+        if (m_fd != -1) {
+            close(m_fd);
+        }
+        throw std::runtime_error("RemoteWorker(): Could not connect to " + socket_path.string() + ": " + std::strerror(err));
+    }
+}
+
+RemoteWorker::~RemoteWorker()
+{
+    close(m_fd);
+}
+
+std::optional<WorkResponse> RemoteWorker::execute(const WorkRequest& request)
+{
+    std::string frame;
+    if (!detail::write_frame(m_fd, request.encode()) || !detail::read_frame(m_fd, frame)) {
+        error("RemoteWorker: Connection lost");
+        return std::nullopt;
+    }
+    try {
+        return WorkResponse::decode(frame);
+    } catch (const std::exception& e) {
+        error("RemoteWorker: Malformed response: ", e.what());
+        return std::nullopt;
+    }
+}
+
+int RemoteWorker::run(const Cmd& cmd,
+                      const std::vector<fs::path>& inputs,
+                      const std::vector<fs::path>& outputs)
+{
+    info("Running on worker: ", cmd);
+    WorkRequest request;
+    request.argv = cmd.args();
+    request.wd = fs::absolute(cmd.wd()).string();
+    for (auto& input : inputs) {
+        auto digest = sha256_file(cmd.wd() / input);
+        if (!digest) {
+            error("RemoteWorker: Could not read input ", input);
+            return 1;
+        }
+        request.inputs.emplace_back(input.string(), *digest);
+    }
+    for (auto& output : outputs) {
+        request.outputs.push_back(output.string());
+    }
+
+    auto response = execute(request);
+    if (!response) {
+        return 1;
+    }
+    std::cout.flush();
+    if (!detail::write_all(STDOUT_FILENO, response->output.data(), response->output.size())) {
+        error("RemoteWorker: Could not print the output of ", cmd, ": ", std::strerror(errno));
+    }
+
+    /* Failing to store an output fails the command, like the worker does when it wasn't produced */
+    int exit_code = response->exit_code;
+    for (auto& [path, contents] : response->files) {
+        if (std::find(request.outputs.begin(), request.outputs.end(), path) == request.outputs.end()) {
+            error("RemoteWorker: Worker sent ", path, ", which wasn't requested");
+            exit_code = exit_code == 0 ? 1 : exit_code;
+            continue;
+        }
+        if (!detail::atomic_write(cmd.wd() / path, contents)) {
+            exit_code = exit_code == 0 ? 1 : exit_code;
+        }
+    }
+    return exit_code;
+}
+
+PersistentWorkerPool::PersistentWorkerPool(Cmd tool, std::size_t count)
+    : m_tool(std::move(tool)), m_count(std::max<std::size_t>(count, 1))
+{
+    m_tool.add("--persistent_worker");
+}
+
+PersistentWorkerPool::~PersistentWorkerPool()
+{
+    for (auto& w : m_workers) {
+        close(w.in);
+        close(w.out);
+        waitpid(w.pid, nullptr, 0);
+    }
+}
 
-namespace {
+int PersistentWorkerPool::request(const std::vector<std::string>& args, std::string* out)
+{
+    Worker& w = acquire();
 
-std::string get_executable_path()
+    detail::Encoder e;
+    e.u32(args.size());
+    for (auto& a : args) {
+        e.str(a);
+    }
+
+    std::string frame;
+    bool ok = detail::write_frame(w.in, e.data()) && detail::read_frame(w.out, frame);
+
+    int exit_code = 1;
+    if (ok) {
+        try {
+            detail::Decoder d(frame);
+            exit_code = static_cast<int>(d.u32());
+            std::string output = d.str();
+            if (out) {
+                *out = std::move(output);
+            } else if (!output.empty()) {
+                std::cout << output << std::flush;
+            }
+        } catch (const std::exception& ex) {
+            error("PersistentWorkerPool: Bad response: ", ex.what());
+            ok = false;
+        }
+    }
+    release(w, ok);
+    return exit_code;
+}
+
+PersistentWorkerPool::Worker& PersistentWorkerPool::acquire()
 {
-    char buf[PATH_MAX] = {0};
-    ssize_t len = readlink("/proc/self/exe", buf, sizeof(buf) - 1);
-    if (len == -1) {
-        throw std::runtime_error("get_executable_path(): Failed to read /proc/self/exe");
+    std::unique_lock<std::mutex> lock(m_mtx);
+    m_cv.wait(lock, [this] { return !m_idle.empty() || m_workers.size() < m_count; });
+    if (!m_idle.empty()) {
+        Worker* w = m_idle.back();
+        m_idle.pop_back();
+        return *w;
     }
-    buf[len] = '\0';
-    return std::string(buf);
+    return m_workers.emplace_back(spawn());
 }
 
+void PersistentWorkerPool::release(Worker& w, bool ok)
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    if (!ok) {
+        /* A worker that broke the protocol is replaced by a fresh one */
+        warning("Persistent worker ", w.pid, " failed, restarting it");
+        close(w.in);
+        close(w.out);
+        kill(w.pid, SIGKILL);
+        waitpid(w.pid, nullptr, 0);
+        w = spawn();
+    }
+    m_idle.push_back(&w);
+    m_cv.notify_one();
 }
 
-namespace nob {
+PersistentWorkerPool::Worker PersistentWorkerPool::spawn()
+{
+    info("Starting persistent worker: ", m_tool);
 
-namespace fs = std::filesystem;
+    std::vector<std::string> args = m_tool.args();
+    std::vector<char*> argv;
+    for (auto& s : args) {
+        argv.push_back(s.data());
+    }
+    argv.push_back(nullptr);
 
-enum class Verbosity {
-    Quiet,
-    Quieter,
-    Verbose,
-};
+    int to_worker[2];
+    int from_worker[2];
+    if (pipe2(to_worker, O_CLOEXEC) == -1 || pipe2(from_worker, O_CLOEXEC) == -1) {
+        throw std::runtime_error("PersistentWorkerPool: pipe failed: " + std::string(std::strerror(errno)));
+    }
 
-enum class LogLevel {
-    Info,
-    Warning,
-    Error,
-};
+    pid_t pid = fork();
+    if (pid < 0) {
+        throw std::runtime_error("PersistentWorkerPool: fork() failed: " + std::string(std::strerror(errno)));
+    } else if (pid == 0) {
+        dup2(to_worker[0], STDIN_FILENO);
+        dup2(from_worker[1], STDOUT_FILENO);
+        if (m_tool.wd() != "." && chdir(m_tool.wd().c_str()) == -1) {
+            perror("PersistentWorkerPool: chdir failed");
+            _exit(1);
+        }
+        execvp(argv[0], argv.data());
+        perror("PersistentWorkerPool: execvp failed");
+        _exit(1);
+    }
 
-template<typename... Args>
-void log(std::ostream& out, LogLevel lvl, Args&&... args)
-{
-    /* TODO: Mutex shouldn't block different streams!! */
-    static std::mutex mtx;
-    std::lock_guard<std::mutex> lock(mtx);
+    close(to_worker[0]);
+    close(from_worker[1]);
+    return Worker { pid, to_worker[1], from_worker[0] };
+}
 
-    switch(lvl) {
-        case LogLevel::Info: {
-            out << "\e[0;34m""[NOB INFO] ""\e[0m";
-        } break;
-        case LogLevel::Warning: {
-            out << "\e[0;33m""[NOB WARNING] ""\e[0m";
-        } break;
-        case LogLevel::Error: {
-            out << "\e[0;31m""[NOB ERROR] ""\e[0m";
-        } break;
-        default: {
-            out << "\e[0;35m""[NOB UNKNOWN] ""\e[0m";
-        } break;
+namespace detail {
+
+/* Parses a Makefile style depfile as written by `-MMD -MF`, returns the prerequisites */
+std::optional<std::vector<fs::path>> parse_depfile(const fs::path& path)
+{
+    auto contents = read_file(path);
+    if (!contents) {
+        return std::nullopt;
     }
 
-    (out << ... << std::forward<Args>(args));
-    out << '\n';
+    std::vector<fs::path> deps;
+    std::string word;
+    bool seen_colon = false;
+    auto flush = [&] {
+        if (!word.empty()) {
+            if (seen_colon) {
+                deps.emplace_back(word);
+            } else if (word.back() == ':') {
+                seen_colon = true;
+            }
+            word.clear();
+        }
+    };
+
+    const std::string& s = *contents;
+    for (std::size_t i = 0; i < s.size(); i++) {
+        char c = s[i];
+        if (c == '\\' && i + 1 < s.size()) {
+            char next = s[i + 1];
+            if (next == '\n') {
+                flush();
+                i++;
+                continue;
+            }
+            if (next == ' ' || next == '#' || next == '\\') {
+                word += next;
+                i++;
+                continue;
+            }
+        }
+        if (c == '$' && i + 1 < s.size() && s[i + 1] == '$') {
+            word += '$';
+            i++;
+            continue;
+        }
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            flush();
+            continue;
+        }
+        word += c;
+        if (!seen_colon && c == ':' && (i + 1 == s.size() || s[i + 1] == ' ' || s[i + 1] == '\n')) {
+            flush();
+        }
+    }
+    flush();
+    return deps;
 }
 
-template<typename... Args>
-void error(Args&&... args)
+/* True when `target` is missing or older than any input listed in its depfile */
+bool depfile_outdated(const fs::path& target, const fs::path& depfile)
 {
-    log(std::cerr, LogLevel::Error, std::forward<Args>(args)...);
+    FileStat target_st = stat_cached(target);
+    if (!target_st.exists) {
+        return true;
+    }
+
+    auto deps = parse_depfile(depfile);
+    if (!deps || deps->empty()) {
+        info("No usable depfile ", depfile);
+        return true;
+    }
+
+    prefetch_stats(*deps);
+    for (auto& dep : *deps) {
+        FileStat dep_st = stat_cached(dep);
+        if (!dep_st.exists || dep_st.mtime > target_st.mtime) {
+            info(dep, " changed");
+            return true;
+        }
+    }
+    return false;
 }
 
-template<typename... Args>
-void info(Args&&... args)
+}
+
+namespace detail {
+
+/* Self-rebuild artifacts (PCH, linker probe) live in .nob/ next to the binary */
+fs::path self_rebuild_dir(const fs::path& binary_path)
 {
-    log(std::cout, LogLevel::Info, std::forward<Args>(args)...);
+    return binary_path.parent_path() / ".nob";
 }
 
-template<typename... Args>
-void warning(Args&&... args)
+/* Returns the -fuse-ld= flag of the fastest linker that works, probed once and cached */
+std::string fast_linker_flag(const fs::path& dir)
 {
-    log(std::cout, LogLevel::Warning, std::forward<Args>(args)...);
+    fs::path cached = dir / "linker";
+    if (auto flag = read_file(cached)) {
+        return *flag;
+    }
+
+    fs::path probe = dir / "linker_probe.cpp";
+    std::ofstream(probe) << "int main() { return 0; }\n";
+
+    std::string flag;
+    for (const char* linker : { "mold", "lld", "gold" }) {
+        std::string candidate = std::string("-fuse-ld=") + linker;
+        Cmd cmd("c++", candidate, probe, "-o", dir / "linker_probe");
+        std::ostringstream discard;
+        if (cmd.run_sync_capture(discard, true) == 0) {
+            flag = candidate;
+            break;
+        }
+    }
+    fs::remove(probe);
+    fs::remove(dir / "linker_probe");
+
+    info("Self-rebuild linker: ", flag.empty() ? "default" : flag);
+    std::ofstream(cached) << flag;
+    return flag;
 }
 
-bool mkdir(const fs::path& path)
+/* The value of a `#define NOB_LOG_LEVEL <n>` in `source`, if it has one */
+std::optional<int> script_log_level(const fs::path& source)
 {
-    if (fs::exists(path)) {
-        if (fs::is_directory(path)) {
-            info(path, " already exists, not creating");
+    std::ifstream file(source);
+    std::string line;
+    while (std::getline(file, line)) {
+        std::string_view rest(line);
+        auto skip_space = [&] {
+            while (!rest.empty() && (rest.front() == ' ' || rest.front() == '\t')) {
+                rest.remove_prefix(1);
+            }
+        };
+        auto take = [&](std::string_view word) {
+            skip_space();
+            if (rest.substr(0, word.size()) != word) {
+                return false;
+            }
+            rest.remove_prefix(word.size());
             return true;
+        };
+        if (!take("#") || !take("define") || !take("NOB_LOG_LEVEL")) {
+            continue;
+        }
+        if (rest.empty() || (rest.front() != ' ' && rest.front() != '\t')) {
+            continue;
         }
+        skip_space();
+        int level;
+        auto [end, ec] = std::from_chars(rest.data(), rest.data() + rest.size(), level);
+        if (ec == std::errc()) {
+            return level;
+        }
+        warning("Could not parse the NOB_LOG_LEVEL defined in ", source, ", the PCH and libnob.a ignore it");
+        return std::nullopt;
+    }
+    return std::nullopt;
+}
 
-        error(path, " already exists and is not a directory");
-        return false;
+/* Finds nob.hpp, preferably through the depfile of the previous rebuild */
+std::optional<fs::path> nob_header_path(const fs::path& depfile)
+{
+    if (auto deps = parse_depfile(depfile)) {
+        for (auto& dep : *deps) {
+            if (dep.filename() == "nob.hpp") {
+                return fs::absolute(dep);
+            }
+        }
+    }
+    if (stat_cached(__FILE__).exists) {
+        return fs::absolute(__FILE__);
+    }
+    return std::nullopt;
+}
+
+/*
+ * (Re)builds a precompiled header for nob.hpp with `flags` and returns the
+ * path to pass to -include, or std::nullopt when no PCH can be used. The PCH
+ * is built from a one-line wrapper that includes nob.hpp by absolute path,
+ * so the script's own `#include "nob.hpp"` is skipped by its include guard.
+ */
+std::optional<fs::path> nob_pch(const fs::path& dir,
+                                const fs::path& depfile,
+                                const std::vector<std::string>& flags)
+{
+    auto header = nob_header_path(depfile);
+    if (!header) {
+        return std::nullopt;
+    }
+
+    fs::path wrapper = dir / "nob_pch.hpp";
+    fs::path gch = dir / "nob_pch.hpp.gch";
+    fs::path pch_depfile = dir / "nob_pch.hpp.d";
+
+    /* The flags go in too, so changing them (e.g. NOB_LOG_LEVEL) makes the PCH outdated */
+    std::string include = "/*";
+    for (auto& flag : flags) {
+        include += " " + flag;
     }
+    include += " */\n#include \"" + header->string() + "\"\n";
+    write_file_if_changed(wrapper, include);
 
-    return fs::create_directories(path);
+    if (depfile_outdated(gch, pch_depfile)) {
+        info("Precompiling ", *header);
+        Cmd cmd("c++");
+        for (auto& flag : flags) {
+            cmd.add(flag);
+        }
+        cmd.add("-x", "c++-header", wrapper, "-o", gch, "-MMD", "-MF", pch_depfile);
+        if (cmd.run_sync() != 0) {
+            warning("Could not precompile ", *header, ", rebuilding without PCH");
+            fs::remove(gch);
+            return std::nullopt;
+        }
+    }
+    return wrapper;
 }
 
-void remove(const fs::path& path)
+}
+
+Progress::Progress(std::vector<std::string> targets, std::size_t jobs, fs::path history)
+    : m_targets(std::move(targets))
+    , m_jobs(std::max<std::size_t>(jobs, 1))
+    , m_history_path(std::move(history))
 {
-    warning("Removing ", path);
-    /* TODO: Ask for confirmation */
-    fs::remove(path);
+    const char* term = std::getenv("TERM");
+    m_tty = isatty(STDOUT_FILENO) && !(term && std::string(term) == "dumb");
+
+    std::ifstream file(m_history_path);
+    double ms;
+    std::string target;
+    while (file >> ms && file.get() == ' ' && std::getline(file, target)) {
+        m_history[target] = ms;
+    }
+
+    double known = 0;
+    std::size_t count = 0;
+    for (const auto& target : m_targets) {
+        auto it = m_history.find(target);
+        if (it != m_history.end()) {
+            known += it->second;
+            count++;
+        }
+    }
+    m_default_ms = count > 0 ? known / count : 0;
+
+    detail::status_line().quiet_cmds.store(true, std::memory_order_release);
+    if (m_tty) {
+        detail::status_line().active.store(true, std::memory_order_release);
+    }
 }
 
-void remove_recursive(const fs::path& path)
+Progress::~Progress()
 {
-    warning("Removing recursively ", path);
-    /* TODO: Ask for confirmation */
-    fs::remove_all(path);
+    if (m_tty) {
+        auto& status = detail::status_line();
+        std::lock_guard<std::mutex> lock(m_mtx);
+        draw_locked(true);
+        status.active.store(false, std::memory_order_release);
+        std::lock_guard<std::mutex> status_lock(status.mtx);
+        status.text.clear();
+        detail::write_all(STDOUT_FILENO, "\n", 1);
+    }
+    detail::status_line().quiet_cmds.store(false, std::memory_order_release);
+    save_history();
 }
 
-fs::path get_project_root()
+void Progress::start(const std::string& target, const std::string& description)
 {
-    return fs::path(get_executable_path()).remove_filename();
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_running[target] = Clock::now();
+    m_started++;
+    m_description = description;
+
+    if (m_tty) {
+        draw_locked(false);
+    } else {
+        std::string line = "[" + std::to_string(m_started) + "/" + std::to_string(m_targets.size()) + "] "
+            + description + "\n";
+        std::cout.flush();
+        std::lock_guard<std::mutex> status_lock(detail::status_line().mtx);
+        detail::write_all(STDOUT_FILENO, line.data(), line.size());
+    }
 }
 
-bool cd(const fs::path& path)
+void Progress::finish(const std::string& target)
 {
-    info("Changing working dir to ", path);
-    fs::current_path(path);
-    return true; /* TODO: Check fail */
+    std::lock_guard<std::mutex> lock(m_mtx);
+    auto it = m_running.find(target);
+    if (it != m_running.end()) {
+        m_measured[target] = std::chrono::duration<double, std::milli>(Clock::now() - it->second).count();
+        m_running.erase(it);
+    }
+    m_finished++;
+
+    if (m_tty) {
+        draw_locked(m_finished == m_targets.size());
+    }
 }
 
-class Cmd {
-public:
-    template<typename... Args>
-    Cmd(Args&&... args)
-    {
-        add(std::forward<Args>(args)...);
+double Progress::expected_ms(const std::string& target) const
+{
+    auto it = m_history.find(target);
+    return it != m_history.end() ? it->second : m_default_ms;
+}
+
+std::string Progress::status_locked(Clock::time_point now) const
+{
+    std::size_t total = m_targets.size();
+    std::string text = "[" + std::to_string(m_finished) + "/" + std::to_string(total) + "] "
+        + std::to_string(total > 0 ? m_finished * 100 / total : 100) + "% ";
+
+    /* Work left, from history: everything not finished minus what's already running */
+    double remaining = 0;
+    for (const auto& target : m_targets) {
+        if (m_measured.count(target) != 0) {
+            continue;
+        }
+        double expected = expected_ms(target);
+        auto running = m_running.find(target);
+        if (running != m_running.end()) {
+            double elapsed = std::chrono::duration<double, std::milli>(now - running->second).count();
+            expected = std::max(expected - elapsed, 0.0);
+        }
+        remaining += expected;
     }
 
-    ~Cmd() = default;
+    if (m_default_ms > 0) {
+        std::size_t left = total - std::min(m_finished, total);
+        long seconds = std::lround(remaining / std::max<std::size_t>(std::min(m_jobs, left), 1) / 1000);
+        text += "ETA ";
+        if (seconds >= 3600) {
+            text += std::to_string(seconds / 3600) + "h" + std::to_string(seconds % 3600 / 60) + "m";
+        } else if (seconds >= 60) {
+            text += std::to_string(seconds / 60) + "m" + std::to_string(seconds % 60) + "s";
+        } else {
+            text += std::to_string(seconds) + "s";
+        }
+        text += " ";
+    }
+    return text + m_description;
+}
 
-    template<typename... Args>
-    void add(Args&&... args)
-    {
-        (m_command.emplace_back(std::forward<Args>(args)), ...);
+void Progress::draw_locked(bool force)
+{
+    /* Terminals are slow, ~30 redraws a second is all anyone can read anyway */
+    auto now = Clock::now();
+    if (!force && now - m_last_draw < std::chrono::milliseconds(33)) {
+        return;
     }
+    m_last_draw = now;
 
-    void set_wd(fs::path&& path)
-    {
-        m_working_dir = std::move(path);
+    std::string text = status_locked(now);
+    struct winsize ws {};
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 1 && text.size() >= ws.ws_col) {
+        text.resize(ws.ws_col - 1);
+    }
+
+    auto& status = detail::status_line();
+    std::cout.flush();
+    std::lock_guard<std::mutex> lock(status.mtx);
+    status.text = text;
+    std::string out = "\r" + text + "\e[K";
+    detail::write_all(STDOUT_FILENO, out.data(), out.size());
+}
+
+void Progress::save_history()
+{
+    if (m_measured.empty()) {
+        return;
+    }
+    for (const auto& [target, ms] : m_measured) {
+        m_history[target] = ms;
+    }
+
+    std::ostringstream out;
+    for (const auto& [target, ms] : m_history) {
+        out << ms << ' ' << target << '\n';
+    }
+    detail::atomic_write(m_history_path, out.str());
+}
+
+void go_rebuild_urself(int argc, char** argv, fs::path source_path)
+{
+    auto binary_path = get_executable_path();
+    fs::path depfile = binary_path + ".d";
+    fs::path dir = detail::self_rebuild_dir(binary_path);
+
+    /* Absolute, so the depfile stays valid whatever dir nob is started from */
+    source_path = fs::absolute(source_path);
+
+    /* Headers that came in through the PCH only show up in the PCH's depfile */
+    auto outdated = [&] {
+        return detail::depfile_outdated(binary_path, depfile)
+            || (stat_cached(dir / "nob_pch.hpp.d").exists && detail::depfile_outdated(binary_path, dir / "nob_pch.hpp.d"));
+    };
+
+    if (!outdated()) {
+        return;
     }
 
-    int run_sync()
     {
-        info("Running sync: ", *this);
-        std::vector<char*> argv;
-        for (auto& s : m_command) {
-            argv.push_back(s.data());
-        }
-        argv.push_back(nullptr);
+        detail::FileLock lock(binary_path + ".lock");
 
-        pid_t pid = fork();
+        /* Whoever held the lock before us may already have rebuilt it, behind the stat cache's back */
+        invalidate_stats();
+        if (outdated()) {
+            info("Rebuilding meself");
+            fs::create_directories(dir);
 
-        if (pid < 0) {
-            throw std::runtime_error("run_sync(): fork() failed: " + std::string(std::strerror(errno)));
-        } else if (pid == 0) {
-            if (m_working_dir != ".") {
-                info("Changing working dir to ", m_working_dir);
-                fs::current_path(m_working_dir);
+            std::vector<std::string> flags = { "-O0" };
+            /* The PCH and libnob.a are compiled apart from the script, they only see its level through -D */
+            if (auto level = detail::script_log_level(source_path)) {
+                flags.push_back("-DNOB_LOG_LEVEL=" + std::to_string(*level));
             }
-            execvp(argv[0], argv.data());
-            perror("run_sync(): execvp failed");
-            _exit(1);
-        } else {
-            int status;
-            waitpid(pid, &status, 0);
-            if (WIFEXITED(status)) {
-                return WEXITSTATUS(status);
-            } else {
-                return 1;
+            auto header = detail::nob_header_path(depfile);
+            auto lib = header ? build_libnob(*header, dir, flags) : std::nullopt;
+            if (lib) {
+                flags.push_back("-DNOB_IMPLEMENTATION_PREBUILT");
+            }
+            /* The PCH is only valid for the exact same flags and macros */
+            auto pch = detail::nob_pch(dir, depfile, flags);
+            /* Lets hot reloaded scripts bind to the launcher's nob functions, see HotReload */
+            flags.push_back("-rdynamic");
+            std::string linker = detail::fast_linker_flag(dir);
+
+            fs::path tmp_binary = detail::temp_path(binary_path);
+            fs::path tmp_depfile = detail::temp_path(depfile);
+
+            Cmd cmd("c++");
+            for (auto& flag : flags) {
+                cmd.add(flag);
+            }
+            if (pch) {
+                cmd.add("-include", *pch);
+            }
+            if (!linker.empty()) {
+                cmd.add(linker);
             }
+            cmd.add(source_path, "-o", tmp_binary, "-MMD", "-MF", tmp_depfile);
+            if (lib) {
+                /* Whole archive, a hot reloaded script may need any of it */
+                cmd.add("-Wl,--whole-archive", *lib, "-Wl,--no-whole-archive");
+            }
+            if (cmd.run_sync() != 0) {
+                fs::remove(tmp_binary);
+                fs::remove(tmp_depfile);
+                throw std::runtime_error("go_rebuild_urself(): Rebuild failed");
+            }
+
+            /* Depfile first: a stale binary next to a new depfile only causes another rebuild */
+            fs::rename(tmp_depfile, depfile);
+            fs::rename(tmp_binary, binary_path);
         }
     }
 
-    /* TODO: handle stderr */
-    int run_sync_capture(std::ostream& out)
-    {
-        info("Running sync capture: ", *this);
+    std::cout.flush();
+    disable_async_log();
+    execvp(binary_path.c_str(), argv);
+    perror("execvp failed");
+    _exit(1);
+}
 
-        std::vector<char*> argv;
-        for (auto s : m_command) {
-            argv.push_back(s.data());
-        }
-        argv.push_back(nullptr);
+std::optional<fs::path> build_libnob(const fs::path& header,
+                                     const fs::path& dir,
+                                     const std::vector<std::string>& flags)
+{
+    fs::create_directories(dir);
+    fs::path wrapper = dir / "libnob.cpp";
+    fs::path object = dir / "libnob.o";
+    fs::path depfile = dir / "libnob.o.d";
+    fs::path lib = dir / "libnob.a";
 
-        int pipefd[2];
-        if (pipe(pipefd) == -1) {
-            throw std::runtime_error("run_sync_capture(): pipe failed");
-        }
+    /* See nob_pch(), the flags are part of what makes the object outdated */
+    std::string contents = "/*";
+    for (auto& flag : flags) {
+        contents += " " + flag;
+    }
+    contents += " */\n#define NOB_IMPLEMENTATION\n#include \"" + fs::absolute(header).string() + "\"\n";
+    write_file_if_changed(wrapper, contents);
 
-        pid_t pid = fork();
-        if (pid < 0) {
-            throw std::runtime_error("run_sync_capture(): fork() failed: " + std::string(std::strerror(errno)));
-        } else if (pid == 0) {
-            close(pipefd[0]);
-            dup2(pipefd[1], STDOUT_FILENO);
-            close(pipefd[1]);
-            execvp(argv[0], argv.data());
-            perror("run_sync_capture(): execvp failed");
-            _exit(1);
-        } else {
-            close(pipefd[1]);
-            char buffer[4096];
-            ssize_t bytes_read;
-            while ((bytes_read = read(pipefd[0], buffer, sizeof(buffer))) != 0) {
-                if (bytes_read == -1) {
-                    if (errno == EINTR) {
-                        continue;
-                    } else {
-                        close(pipefd[0]);
-                        throw std::runtime_error("run_sync_capture(): Error reading from pipe");
-                    }
-                }
-                out.write(buffer, bytes_read);
-            }
+    if (detail::depfile_outdated(object, depfile)) {
+        info("Compiling ", lib);
+        Cmd cmd("c++");
+        for (auto& flag : flags) {
+            cmd.add(flag);
+        }
+        cmd.add("-c", wrapper, "-o", object, "-MMD", "-MF", depfile);
+        if (cmd.run_sync() != 0) {
+            error("Could not compile ", header);
+            return std::nullopt;
+        }
+        fs::remove(lib);
+        invalidate_stats(lib);
+    }
 
-            int status;
-            waitpid(pid, &status, 0);
-            close(pipefd[0]);
-            out.flush();
-            if (WIFEXITED(status)) {
-                return WEXITSTATUS(status);
-            } else {
-                return 1;
-            }
+    if (!stat_cached(lib).exists) {
+        fs::path tmp = detail::temp_path(lib);
+        Cmd ar("ar", "rcs", tmp, object);
+        if (ar.run_sync() != 0) {
+            error("Could not archive ", lib);
+            return std::nullopt;
         }
+        fs::rename(tmp, lib);
+        invalidate_stats(lib);
     }
+    return lib;
+}
 
-    void reset()
-    {
-        m_working_dir = ".";
-        m_command.clear();
+HotReload::HotReload(fs::path source_path, fs::path dir)
+    : m_source_path(fs::absolute(source_path)),
+      m_dir(dir.empty() ? detail::self_rebuild_dir(get_executable_path()) : std::move(dir))
+{
+    m_so_path = m_dir / (m_source_path.stem().string() + ".so");
+    m_depfile = m_so_path.string() + ".d";
+}
+
+HotReload::~HotReload()
+{
+    unload();
+}
+
+bool HotReload::reload_if_changed()
+{
+    if (m_handle && !detail::depfile_outdated(m_so_path, m_depfile)) {
+        return true;
     }
 
-    friend std::ostream& operator<<(std::ostream& os, const Cmd& cmd)
     {
-        os << "Cmd working dir: " << cmd.m_working_dir << "; ";
-        for (auto s : cmd.m_command) {
-            os << s << ' ';
+        fs::create_directories(m_dir);
+        detail::FileLock lock(m_so_path.string() + ".lock");
+        if (detail::depfile_outdated(m_so_path, m_depfile)) {
+            info("Compiling ", m_source_path, " to ", m_so_path);
+            fs::path tmp_so = detail::temp_path(m_so_path);
+            fs::path tmp_depfile = detail::temp_path(m_depfile);
+
+            /* -fno-gnu-unique, or static locals of inline functions keep the object from unloading */
+            Cmd cmd("c++", "-O0", "-shared", "-fPIC", "-fno-gnu-unique", "-DNOB_HOT_RELOADED",
+                    m_source_path, "-o", tmp_so, "-MMD", "-MF", tmp_depfile);
+            if (cmd.run_sync() != 0) {
+                fs::remove(tmp_so);
+                fs::remove(tmp_depfile);
+                error("Could not compile ", m_source_path);
+                return false;
+            }
+            fs::rename(tmp_depfile, m_depfile);
+            fs::rename(tmp_so, m_so_path);
+        } else if (m_handle) {
+            return true;
         }
-        return os;
     }
 
-private:
-    std::vector<std::string> m_command;
-    fs::path m_working_dir { "." };
-};
+    unload();
+    m_handle = dlopen(m_so_path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!m_handle) {
+        error("dlopen(): ", dlerror());
+        return false;
+    }
+    m_entry = reinterpret_cast<int (*)(int, char**)>(dlsym(m_handle, "nob_main"));
+    if (!m_entry) {
+        error(m_so_path, " does not export nob_main: ", dlerror());
+        unload();
+        return false;
+    }
+    info("Loaded ", m_so_path);
+    return true;
+}
 
-void go_rebuild_urself(int argc, char** argv, fs::path source_path)
+int HotReload::run(int argc, char** argv)
 {
-    auto binary_path = get_executable_path();
-
-    auto binary_time = fs::last_write_time(binary_path);
-    auto source_time = fs::last_write_time(source_path);
+    if (!reload_if_changed()) {
+        return 1;
+    }
+    return m_entry(argc, argv);
+}
 
-    if (source_time > binary_time) {
-        info("Rebuilding meself");
-        Cmd cmd("c++", source_path, "-o", binary_path);
-        if (cmd.run_sync() != 0) {
-            throw std::runtime_error("go_rebuild_urself(): Rebuild failed");
+int HotReload::watch(int argc, char** argv, std::chrono::milliseconds poll)
+{
+    for (;;) {
+        int status = run(argc, argv);
+        if (status != 0) {
+            return status;
         }
-        execvp(binary_path.c_str(), argv);
-        perror("execvp failed");
-        _exit(1);
+        info("Watching ", m_source_path, " for changes");
+        while (!detail::depfile_outdated(m_so_path, m_depfile)) {
+            std::this_thread::sleep_for(poll);
+        }
+    }
+}
+
+void HotReload::unload()
+{
+    if (m_handle) {
+        dlclose(m_handle);
     }
+    m_handle = nullptr;
+    m_entry = nullptr;
+}
+
+int go_hot_reload(int argc, char** argv, fs::path source_path, bool watch)
+{
+    HotReload script(std::move(source_path));
+    return watch ? script.watch(argc, argv) : script.run(argc, argv);
 }
 
 bool download(const std::string& url,
-              std::optional<fs::path> out = std::nullopt,
-              std::optional<Verbosity> v = std::nullopt)
+              std::optional<fs::path> out,
+              std::optional<Verbosity> v)
 {
     Cmd cmd("curl",
             "-L" /* Follow redirects */
@@ -301,12 +5452,21 @@ bool download(const std::string& url,
     }
     cmd.add(url);
 
-    return cmd.run_sync() == 0;
+    auto start = std::chrono::steady_clock::now();
+    bool ok = cmd.run_sync() == 0;
+    if (event_log_enabled()) {
+        fs::path file = out.value_or(fs::path(url.substr(url.find_last_of('/') + 1)));
+        Event("download").field("url", url).field("path", file).field("ok", ok)
+            .field("bytes", ok ? stat_cached(file).size : 0)
+            .field("duration_ms", std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count())
+            .emit();
+    }
+    return ok;
 }
 
 bool extract_tar_gz(const fs::path& archive,
-                    std::optional<fs::path> out = std::nullopt,
-                    std::optional<Verbosity> v = std::nullopt)
+                    std::optional<fs::path> out,
+                    std::optional<Verbosity> v)
 {
     Cmd cmd { "tar",
             "-x",
@@ -331,8 +5491,8 @@ bool extract_tar_gz(const fs::path& archive,
 }
 
 bool extract_tar_bz2(const fs::path& archive,
-                     std::optional<fs::path> out = std::nullopt,
-                     std::optional<Verbosity> v = std::nullopt)
+                     std::optional<fs::path> out,
+                     std::optional<Verbosity> v)
 {
     Cmd cmd { "tar",
             "-x", /* Extract */
@@ -356,8 +5516,8 @@ bool extract_tar_bz2(const fs::path& archive,
 }
 
 bool extract_bz2(const fs::path& compressed,
-                 std::optional<fs::path> out = std::nullopt,
-                 std::optional<Verbosity> v = std::nullopt)
+                 std::optional<fs::path> out,
+                 std::optional<Verbosity> v)
 {
     Cmd cmd { "bzip2", "-d" }; /* Decompress */
 
@@ -390,8 +5550,8 @@ bool extract_bz2(const fs::path& compressed,
 }
 
 bool extract_zip(const fs::path& archive,
-                 std::optional<fs::path> out = std::nullopt,
-                 std::optional<Verbosity> v = std::nullopt)
+                 std::optional<fs::path> out,
+                 std::optional<Verbosity> v)
 {
     Cmd cmd { "unzip" };
 
@@ -414,8 +5574,8 @@ bool extract_zip(const fs::path& archive,
 }
 
 bool extract_gz(const fs::path& compressed,
-                std::optional<fs::path> out = std::nullopt,
-                std::optional<Verbosity> v = std::nullopt)
+                std::optional<fs::path> out,
+                std::optional<Verbosity> v)
 {
     Cmd cmd("gunzip");
 
@@ -450,8 +5610,8 @@ bool extract_gz(const fs::path& compressed,
 }
 
 bool extract(const fs::path& in,
-             std::optional<fs::path> out = std::nullopt,
-             std::optional<Verbosity> v = std::nullopt)
+             std::optional<fs::path> out,
+             std::optional<Verbosity> v)
 {
     /* Detect from extensions? or metadata? */
 
@@ -460,7 +5620,9 @@ bool extract(const fs::path& in,
     if (in.extension() == ".gz") {
         fs::path no_gz = in.stem();
         if (no_gz.extension() == ".tar") {
-            output = output.stem();
+            if (!out) {
+                output = output.stem();
+            }
             return extract_tar_gz(in, output, v);
         } else {
             return extract_gz(in, output, v);
@@ -480,10 +5642,15 @@ bool extract(const fs::path& in,
 }
 
 bool download_and_extract(const std::string& url,
-                          std::optional<fs::path> out = std::nullopt,
-                          std::optional<Verbosity> v = std::nullopt)
+                          std::optional<fs::path> out,
+                          std::optional<Verbosity> v)
 {
+    /* Next to what it extracts to, so nothing depends on the cwd */
     fs::path archive_path = fs::path(url.substr(url.find_last_of('/') + 1));
+    if (out) {
+        mkdir(*out);
+        archive_path = *out / archive_path;
+    }
 
     if (!download(url, archive_path, v)) {
         return false;
@@ -493,3 +5660,5 @@ bool download_and_extract(const std::string& url,
 }
 
 }
+
+#endif /* NOB_IMPLEMENTATION */
@@ -0,0 +1,81 @@
+/*
+ * Cmd construction and formatting.
+ *
+ *     c++ -std=c++17 -pthread tests/cmd.cpp -o cmd && ./cmd
+ */
+#define NOB_IMPLEMENTATION
+#include "../nob.hpp"
+
+using namespace nob;
+
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static void test_copy()
+{
+    /* A named, non-const Cmd must go to the copy constructor, not become an argument */
+    Cmd c("echo", "hi");
+    c.set_wd("/tmp");
+    Cmd copy(c);
+    CHECK(copy.args() == c.args());
+    CHECK(copy.wd() == c.wd());
+
+    const Cmd& ref = c;
+    Cmd from_const(ref);
+    CHECK(from_const.args() == c.args());
+
+    Cmd moved(std::move(copy));
+    CHECK(moved.args() == c.args());
+
+    Cmd assigned;
+    assigned = c;
+    CHECK(assigned.args() == c.args());
+
+    /* Several arguments still append, even when there are two */
+    Cmd two("a", "b");
+    CHECK(two.args() == std::vector<std::string>({ "a", "b" }));
+}
+
+static void test_worker_pool_from_named_cmd()
+{
+    Cmd tool("cat");
+    PersistentWorkerPool pool(tool, 1);
+    CHECK(tool.args() == std::vector<std::string>({ "cat" }));
+}
+
+static void test_format()
+{
+    /* Same text as std::ostream gives by default */
+    for (double d : { 0.1, 1.0 / 3, 1234567.0, 1e-7, -2.5, 100.0 }) {
+        std::ostringstream expected;
+        expected << d;
+        CHECK(format(d) == expected.str());
+    }
+    CHECK(format(true, false) == "10");
+    CHECK(format(42, ' ', -7L, ' ', 3.5f) == "42 -7 3.5");
+
+    Cmd c("echo", "hello world");
+    CHECK(format(c) == "Cmd working dir: \".\"; echo 'hello world'");
+}
+
+int main()
+{
+    set_log_level(LogLevel::Error);
+    test_copy();
+    test_worker_pool_from_named_cmd();
+    test_format();
+
+    if (failures > 0) {
+        std::fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    std::printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,271 @@
+/*
+ * RemoteCache and HttpClient against an in-process stand-in server.
+ *
+ *     c++ -std=c++17 -pthread tests/remote_cache.cpp -o remote_cache && ./remote_cache
+ */
+#define NOB_IMPLEMENTATION
+#include "../nob.hpp"
+
+using namespace nob;
+
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+/*
+ * Enough of bazel-remote for the client: stores PUT bodies and serves them
+ * to GETs, except for paths given a canned response with set_raw(), for
+ * what a real server shouldn't send.
+ */
+class StandInServer {
+public:
+    StandInServer()
+    {
+        m_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in addr {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(m_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1 || listen(m_fd, 64) == -1) {
+            throw std::runtime_error(std::string("StandInServer(): ") + std::strerror(errno));
+        }
+        socklen_t len = sizeof(addr);
+        getsockname(m_fd, reinterpret_cast<sockaddr*>(&addr), &len);
+        m_port = std::to_string(ntohs(addr.sin_port));
+        m_accept = std::thread([this] { accept_loop(); });
+    }
+
+    ~StandInServer()
+    {
+        shutdown(m_fd, SHUT_RDWR);
+        m_accept.join();
+        close(m_fd);
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            for (int fd : m_connections) {
+                shutdown(fd, SHUT_RDWR);
+            }
+        }
+        for (auto& thread : m_threads) {
+            thread.join();
+        }
+    }
+
+    const std::string& port() const
+    {
+        return m_port;
+    }
+
+    std::size_t max_connections()
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        return m_max_open;
+    }
+
+    void set_raw(const std::string& path, const std::string& response)
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_raw[path] = response;
+    }
+
+private:
+    void accept_loop()
+    {
+        for (;;) {
+            int fd = accept4(m_fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd == -1) {
+                return;
+            }
+            std::lock_guard<std::mutex> lock(m_mtx);
+            m_connections.push_back(fd);
+            m_max_open = std::max(m_max_open, m_connections.size());
+            m_threads.emplace_back([this, fd] { serve(fd); });
+        }
+    }
+
+    void serve(int fd)
+    {
+        std::string buf;
+        for (;;) {
+            std::size_t end;
+            while ((end = buf.find("\r\n\r\n")) == std::string::npos) {
+                if (!fill(fd, buf)) {
+                    return disconnect(fd);
+                }
+            }
+            std::string head = buf.substr(0, end);
+            buf.erase(0, end + 4);
+
+            std::string method = head.substr(0, head.find(' '));
+            std::string path = head.substr(method.size() + 1, head.find(' ', method.size() + 1) - method.size() - 1);
+            std::size_t length = 0;
+            auto cl = head.find("Content-Length: ");
+            if (cl != std::string::npos) {
+                length = std::stoull(head.substr(cl + 16));
+            }
+            while (buf.size() < length) {
+                if (!fill(fd, buf)) {
+                    return disconnect(fd);
+                }
+            }
+            std::string body = buf.substr(0, length);
+            buf.erase(0, length);
+
+            std::string response;
+            bool close_after = false;
+            {
+                std::lock_guard<std::mutex> lock(m_mtx);
+                auto raw = m_raw.find(path);
+                if (raw != m_raw.end()) {
+                    response = raw->second;
+                    close_after = true;
+                } else if (method == "PUT") {
+                    m_blobs[path] = body;
+                    response = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n";
+                } else if (auto it = m_blobs.find(path); it != m_blobs.end()) {
+                    response = "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(it->second.size()) + "\r\n\r\n" + it->second;
+                } else {
+                    response = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+                }
+            }
+            if (send(fd, response.data(), response.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(response.size()) || close_after) {
+                return disconnect(fd);
+            }
+        }
+    }
+
+    static bool fill(int fd, std::string& buf)
+    {
+        char chunk[4096];
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0) {
+            return false;
+        }
+        buf.append(chunk, n);
+        return true;
+    }
+
+    void disconnect(int fd)
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_connections.erase(std::find(m_connections.begin(), m_connections.end(), fd));
+        close(fd);
+    }
+
+    int m_fd;
+    std::string m_port;
+    std::thread m_accept;
+    std::vector<std::thread> m_threads;
+    std::vector<int> m_connections;
+    std::size_t m_max_open = 0;
+    std::map<std::string, std::string> m_blobs;
+    std::map<std::string, std::string> m_raw;
+    std::mutex m_mtx;
+};
+
+static void test_round_trip(StandInServer& server, const fs::path& tmp)
+{
+    RemoteCache cache("http://127.0.0.1:" + server.port() + "/cache", 4);
+    CHECK(!cache.get(RemoteCache::Store::Cas, sha256("missing")));
+    CHECK(cache.put(RemoteCache::Store::Cas, sha256("blob"), "blob"));
+    CHECK(cache.get(RemoteCache::Store::Cas, sha256("blob")) == std::optional<std::string>("blob"));
+
+    fs::path in = tmp / "in.o";
+    write_file_if_changed(in, "object file");
+    CHECK(cache.store_output("action", in));
+    CHECK(cache.fetch_output("action", tmp / "out" / "in.o"));
+    CHECK(read_file(tmp / "out" / "in.o") == std::optional<std::string>("object file"));
+    CHECK(!cache.fetch_output("unknown action", tmp / "out" / "unknown.o"));
+}
+
+static void test_parallel_fetch(StandInServer& server, const fs::path& tmp)
+{
+    RemoteCache cache("http://127.0.0.1:" + server.port() + "/cache", 4);
+    std::vector<std::pair<std::string, fs::path>> outputs;
+    for (int i = 0; i < 64; i++) {
+        fs::path in = tmp / ("obj" + std::to_string(i));
+        write_file_if_changed(in, std::string(1000 + i, 'a' + i % 26));
+        CHECK(cache.store_output("parallel" + std::to_string(i), in));
+        outputs.emplace_back("parallel" + std::to_string(i), tmp / "fetched" / in.filename());
+    }
+    outputs.emplace_back("parallel missing", tmp / "fetched" / "missing");
+
+    auto ok = cache.fetch_outputs(outputs);
+    CHECK(ok.size() == outputs.size());
+    for (int i = 0; i < 64; i++) {
+        CHECK(ok[i]);
+        CHECK(read_file(outputs[i].second) == std::optional<std::string>(std::string(1000 + i, 'a' + i % 26)));
+    }
+    CHECK(!ok.back());
+    CHECK(server.max_connections() <= 4);
+}
+
+static void test_malformed_responses(StandInServer& server)
+{
+    HttpClient http("127.0.0.1", server.port(), 2);
+
+    server.set_raw("/empty-header", "HTTP/1.1 200 OK\r\nX-Empty:\r\nContent-Length: 2\r\n\r\nok");
+    auto empty = http.request("GET", "/empty-header");
+    CHECK(empty && empty->status == 200 && empty->body == "ok");
+
+    server.set_raw("/chunked", "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n2;ext=1\r\nok\r\n3\r\n!!!\r\n0\r\n\r\n");
+    auto chunked = http.request("GET", "/chunked");
+    CHECK(chunked && chunked->body == "ok!!!");
+
+    server.set_raw("/until-close", "HTTP/1.0 200 OK\r\n\r\nuntil close");
+    auto until_close = http.request("GET", "/until-close");
+    CHECK(until_close && until_close->body == "until close");
+
+    server.set_raw("/bad-length", "HTTP/1.1 200 OK\r\nContent-Length: lots\r\n\r\nok");
+    CHECK(!http.request("GET", "/bad-length"));
+
+    server.set_raw("/negative-length", "HTTP/1.1 200 OK\r\nContent-Length: -1\r\n\r\nok");
+    CHECK(!http.request("GET", "/negative-length"));
+
+    server.set_raw("/bad-chunk", "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\nok\r\n0\r\n\r\n");
+    CHECK(!http.request("GET", "/bad-chunk"));
+
+    server.set_raw("/huge-chunk", "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nffffffffffffffffffff\r\n");
+    CHECK(!http.request("GET", "/huge-chunk"));
+
+    server.set_raw("/not-http", "SMTP ready\r\n\r\n");
+    CHECK(!http.request("GET", "/not-http"));
+
+    /* Failed requests gave their connections back, the pool of 2 still works */
+    for (int i = 0; i < 4; i++) {
+        auto response = http.request("GET", "/cache/none");
+        CHECK(response && response->status == 404);
+    }
+}
+
+int main()
+{
+    set_log_level(LogLevel::Error);
+    char tmpl[] = "/tmp/nob_remote_cache_XXXXXX";
+    fs::path tmp = mkdtemp(tmpl);
+    {
+        StandInServer server;
+        test_round_trip(server, tmp);
+    }
+    {
+        StandInServer server;
+        test_parallel_fetch(server, tmp);
+    }
+    {
+        StandInServer server;
+        test_malformed_responses(server);
+    }
+    fs::remove_all(tmp);
+
+    if (failures > 0) {
+        std::fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    std::printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,86 @@
+/*
+ * WorkerServer and RemoteWorker over a Unix domain socket.
+ *
+ *     c++ -std=c++17 -pthread tests/worker.cpp -o worker && ./worker
+ */
+#define NOB_IMPLEMENTATION
+#include "../nob.hpp"
+
+using namespace nob;
+
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static void test_round_trip(const fs::path& socket, const fs::path& tmp)
+{
+    write_file_if_changed(tmp / "in.txt", "input");
+
+    RemoteWorker worker(socket);
+    WorkRequest request;
+    request.argv = { "sh", "-c", "cat in.txt > out.txt && echo done" };
+    request.wd = tmp.string();
+    request.inputs.emplace_back("in.txt", *sha256_file(tmp / "in.txt"));
+    request.outputs.push_back("out.txt");
+
+    auto response = worker.execute(request);
+    CHECK(response && response->exit_code == 0);
+    CHECK(response && response->output == "done\n");
+    CHECK(response && response->files == decltype(response->files)({ { "out.txt", "input" } }));
+
+    /* The same connection takes more requests */
+    request.argv = { "sh", "-c", "exit 3" };
+    request.outputs.clear();
+    response = worker.execute(request);
+    CHECK(response && response->exit_code == 3);
+
+    request.inputs = { { "in.txt", sha256("something else") } };
+    response = worker.execute(request);
+    CHECK(response && response->exit_code != 0 && response->output.find("in.txt") != std::string::npos);
+}
+
+static void test_many_connections(const fs::path& socket)
+{
+    WorkRequest request;
+    request.argv = { "true" };
+    for (int i = 0; i < 32; i++) {
+        RemoteWorker worker(socket);
+        auto response = worker.execute(request);
+        CHECK(response && response->exit_code == 0);
+    }
+}
+
+int main()
+{
+    set_log_level(LogLevel::Error);
+    char tmpl[] = "/tmp/nob_worker_XXXXXX";
+    fs::path tmp = mkdtemp(tmpl);
+    fs::path socket = tmp / "worker.sock";
+    {
+        WorkerServer server(socket);
+        std::thread serving([&] { server.serve(); });
+
+        test_round_trip(socket, tmp);
+        test_many_connections(socket);
+
+        /* A client still connected must not keep the server from shutting down */
+        RemoteWorker idle(socket);
+        server.stop();
+        serving.join();
+    }
+    CHECK(!fs::exists(socket));
+    fs::remove_all(tmp);
+
+    if (failures > 0) {
+        std::fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    std::printf("OK\n");
+    return 0;
+}